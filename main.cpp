@@ -7,12 +7,20 @@
 #include <QFile>
 
 #include "tileloader.h"
+#include "tilesource.h"
+#include "mbtilestilesource.h"
+#include "pmtilestilesource.h"
 
 int main(int argc, char *argv[])
 {
     QGuiApplication app(argc, argv);
 
     qmlRegisterType<TileLoader>("com.example", 1, 0, "TileLoader");
+    qmlRegisterUncreatableType<TileSource>("com.example", 1, 0, "TileSource", "TileSource is abstract.");
+    qmlRegisterType<HttpTileSource>("com.example", 1, 0, "HttpTileSource");
+    qmlRegisterType<LocalDirectoryTileSource>("com.example", 1, 0, "LocalDirectoryTileSource");
+    qmlRegisterType<MbTilesTileSource>("com.example", 1, 0, "MbTilesTileSource");
+    qmlRegisterType<PmTilesTileSource>("com.example", 1, 0, "PmTilesTileSource");
 
 #if defined(Q_OS_ANDROID)
     qputenv("QSG_RHI_BACKEND", "vulkan");
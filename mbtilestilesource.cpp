@@ -0,0 +1,181 @@
+#include "mbtilestilesource.h"
+
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThreadStorage>
+
+#include <atomic>
+#include <map>
+
+// A connection of one thread to the file of one source.
+class MbTilesConnection
+{
+public:
+    QString name;
+    QString path;
+    // Prepared once, then reused for every tile read through this connection.
+    std::unique_ptr<QSqlQuery> query;
+
+    ~MbTilesConnection()
+    {
+        // The query refers to the database, so it has to go first.
+        query.reset();
+        QSqlDatabase::removeDatabase(name);
+    }
+};
+
+// The connections of a single thread, one for each source that has read on it.
+// QThreadStorage deletes them on that same thread when it finishes, which is
+// the only thread that's allowed to close them.
+using ThreadConnections = std::map<quint64, std::unique_ptr<MbTilesConnection>>;
+static QThreadStorage<ThreadConnections*> threadConnections;
+
+static std::atomic<quint64> nextSourceId = 0;
+static std::atomic<quint64> nextConnectionId = 0;
+
+MbTilesTileSource::MbTilesTileSource(QObject* parent) :
+    TileSource{ parent },
+    m_sourceId{ nextSourceId++ }
+{
+}
+
+QString MbTilesTileSource::getPath() const
+{
+    auto autoLock = std::lock_guard{ *_propertiesLock };
+    return m_path;
+}
+
+void MbTilesTileSource::setPath(QString const& newValue)
+{
+    bool changed = false;
+    {
+        auto autoLock = std::lock_guard{ *_propertiesLock };
+        changed = newValue != m_path;
+        m_path = newValue;
+    }
+    if (changed) {
+        emit pathChanged();
+    }
+}
+
+MbTilesConnection* MbTilesTileSource::getThreadConnection(QString* errorString)
+{
+    if (!threadConnections.hasLocalData()) {
+        threadConnections.setLocalData(new ThreadConnections);
+    }
+    auto& connections = *threadConnections.localData();
+
+    auto path = getPath();
+    auto it = connections.find(m_sourceId);
+    if (it != connections.end() && it->second->path == path) {
+        return it->second.get();
+    }
+    if (it != connections.end()) {
+        connections.erase(it);
+    }
+
+    auto connection = std::make_unique<MbTilesConnection>();
+    connection->name = QString("mbtiles_%1").arg(nextConnectionId++);
+    connection->path = path;
+    auto db = QSqlDatabase::addDatabase("QSQLITE", connection->name);
+    db.setDatabaseName(path);
+    db.setConnectOptions("QSQLITE_OPEN_READONLY");
+    if (!db.open()) {
+        *errorString = "Unable to open MBTiles file: " + db.lastError().text();
+        qWarning() << "Unable to open MBTiles file" << path << ":" << db.lastError().text();
+        return nullptr;
+    }
+
+    connection->query = std::make_unique<QSqlQuery>(db);
+    connection->query->setForwardOnly(true);
+    bool prepareSuccess = connection->query->prepare(
+        "SELECT tile_data FROM tiles "
+        "WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?");
+    if (!prepareSuccess) {
+        *errorString = "Unable to query MBTiles file: " + connection->query->lastError().text();
+        return nullptr;
+    }
+
+    auto* result = connection.get();
+    connections[m_sourceId] = std::move(connection);
+    return result;
+}
+
+void MbTilesTileSource::fetchTile(TileCoord coord, FetchCallback callback)
+{
+    fetchTiles(
+        { coord },
+        [&](TileCoord, TileFetchResult result) {
+            callback(std::move(result));
+        });
+}
+
+static void failTiles(
+    std::vector<TileCoord> const& coords,
+    TileSource::BatchFetchCallback const& callback,
+    QString const& reason)
+{
+    for (auto const& coord : coords) {
+        TileFetchResult result;
+        result.status = TileFetchResult::Status::Error;
+        result.errorString = reason;
+        callback(coord, std::move(result));
+    }
+}
+
+void MbTilesTileSource::fetchTiles(std::vector<TileCoord> const& coords, BatchFetchCallback callback)
+{
+    QString errorString;
+    auto* connection = getThreadConnection(&errorString);
+    if (connection == nullptr) {
+        failTiles(coords, callback, errorString);
+        return;
+    }
+    readTiles(*connection, coords, callback);
+}
+
+void MbTilesTileSource::readTiles(
+    MbTilesConnection& connection,
+    std::vector<TileCoord> const& coords,
+    BatchFetchCallback const& callback)
+{
+    auto db = QSqlDatabase::database(connection.name, false);
+    auto& query = *connection.query;
+
+    // One transaction for the whole batch means SQLite only
+    // takes its shared lock once.
+    db.transaction();
+
+    for (auto const& coord : coords) {
+        TileFetchResult result;
+
+        // MBTiles uses TMS numbering, which has the Y axis flipped.
+        int tileRow = (1 << coord.level) - 1 - coord.y;
+        query.bindValue(0, coord.level);
+        query.bindValue(1, coord.x);
+        query.bindValue(2, tileRow);
+
+        if (!query.exec()) {
+            result.status = TileFetchResult::Status::Error;
+            result.errorString = "Unable to query MBTiles file: " + query.lastError().text();
+        } else if (!query.next()) {
+            result.status = TileFetchResult::Status::NotFound;
+            result.errorString = "Tile is not in the MBTiles file.";
+        } else {
+            auto bytesOpt = decompressTileBytesIfGzipped(query.value(0).toByteArray());
+            if (bytesOpt.has_value()) {
+                result.status = TileFetchResult::Status::Success;
+                result.bytes = std::move(bytesOpt.value());
+            } else {
+                result.status = TileFetchResult::Status::Error;
+                result.errorString = "Unable to decompress tile from MBTiles file.";
+            }
+        }
+        query.finish();
+
+        callback(coord, std::move(result));
+    }
+
+    db.commit();
+}
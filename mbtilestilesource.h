@@ -0,0 +1,71 @@
+#ifndef MBTILESTILESOURCE_H
+#define MBTILESTILESOURCE_H
+
+#include "tilesource.h"
+
+#include <QString>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class MbTilesConnection;
+
+// Reads tiles out of an MBTiles file, which is an SQLite database
+// with every tile stored as a blob.
+//
+// Each thread that reads tiles keeps a read-only connection of its own, along
+// with the prepared statement, since Qt only lets a database connection be used
+// and removed by the thread that opened it. The connection is closed when the
+// thread finishes. All the tiles in a batch are read inside a single transaction.
+class MbTilesTileSource : public TileSource
+{
+    Q_OBJECT
+    Q_PROPERTY(
+        QString path
+        READ getPath
+        WRITE setPath
+        NOTIFY pathChanged)
+
+public:
+    explicit MbTilesTileSource(QObject* parent = nullptr);
+
+    // Path to the .mbtiles file.
+    //
+    // Should be set before the TileLoader starts requesting tiles.
+    QString getPath() const;
+    void setPath(QString const& newValue);
+
+    // The tiles are read on the calling thread, which is
+    // one of the TileLoader's I/O threads.
+    void fetchTile(TileCoord coord, FetchCallback callback) override;
+    void fetchTiles(std::vector<TileCoord> const& coords, BatchFetchCallback callback) override;
+    // Reading a batch only takes SQLite's shared lock once.
+    bool prefersBatchedFetches() const override { return true; }
+    bool isCacheable() const override { return false; }
+    QString getCacheName() const override { return "mbtiles"; }
+
+private:
+    // Returns the connection of the calling thread, opening it if this thread
+    // hasn't read from this source yet or the path has changed.
+    // Returns nullptr if the file can't be opened.
+    MbTilesConnection* getThreadConnection(QString* errorString);
+    // Reads the tiles using the given connection.
+    static void readTiles(
+        MbTilesConnection& connection,
+        std::vector<TileCoord> const& coords,
+        BatchFetchCallback const& callback);
+
+    // IMPORTANT: This variable is ONLY available when _propertiesLock is locked.
+    QString m_path;
+    std::unique_ptr<std::mutex> _propertiesLock = std::make_unique<std::mutex>();
+
+    // Identifies this source among the connections of a thread. Unlike the
+    // address, it's never reused by a source that's created later.
+    quint64 const m_sourceId;
+
+signals:
+    void pathChanged();
+};
+
+#endif // MBTILESTILESOURCE_H
@@ -0,0 +1,496 @@
+// A tile server for benchmarking the TileLoader without any outside service.
+//
+// Serves vector tiles from a directory over HTTP/1.1, while simulating the
+// conditions of a real network and tile server: latency, a bandwidth cap
+// shared by all connections, failing requests and wrong content types.
+// Responses carry an ETag, a Last-Modified and optionally a Cache-Control
+// header, and both kinds of conditional requests are answered, so that
+// revalidation can be exercised too.
+//
+// Point the app at it by setting the TILE_SOURCE_URL environment variable
+// to the URL template that is printed at startup.
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHostAddress>
+#include <QLocale>
+#include <QRandomGenerator>
+#include <QRegularExpression>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimeZone>
+#include <QTimer>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+struct MockTileServerConfig {
+    QString rootPath;
+    // Path of a tile relative to the root directory, and to the root of the URL.
+    QString pathTemplate = "{z}/{x}/{y}.mvt";
+    // Added before every response. Each response gets a random extra
+    // delay of up to jitterMs on top.
+    int latencyMs = 0;
+    int jitterMs = 0;
+    // Shared by all connections, like the link to a real server.
+    // 0 means unlimited.
+    qint64 bandwidthBytesPerSec = 0;
+    // The fraction of requests that fail with errorStatus.
+    double errorRate = 0.0;
+    int errorStatus = 503;
+    QByteArray contentType = "application/x-protobuf";
+    // The fraction of tiles that are sent as text/html instead,
+    // like a captive portal or a misconfigured proxy would.
+    double badContentTypeRate = 0.0;
+    // -1 leaves out the Cache-Control header.
+    int maxAgeSecs = -1;
+    bool verbose = false;
+};
+
+class MockTileServer
+{
+public:
+    MockTileServer(MockTileServerConfig const& config, quint32 seed);
+
+    bool listen(QHostAddress const& address, quint16 port);
+    quint16 serverPort() const { return m_server.serverPort(); }
+
+private:
+    struct Connection {
+        QByteArray received;
+        // Response bytes waiting to go out under the bandwidth cap.
+        QByteArray unsent;
+        // Set while a request is being answered. Requests are answered
+        // one at a time, in the order they came in.
+        bool busy = false;
+        bool closeWhenSent = false;
+    };
+
+    void handleNewConnections();
+    void handleNextRequest(QTcpSocket* socket);
+    QByteArray buildResponse(
+        QByteArray const& method,
+        QByteArray const& target,
+        std::map<QByteArray, QByteArray> const& headers);
+    void queueResponse(QTcpSocket* socket, QByteArray const& response);
+    // Sends as much as the bandwidth cap allows. Called on every tick of m_pacingTimer.
+    void sendPacedBytes();
+    void finishResponse(QTcpSocket* socket);
+
+    static QByteArray buildHeaders(int status, std::vector<std::pair<QByteArray, QByteArray>> const& headers);
+    static QByteArray toHttpDate(QDateTime const& dateTime);
+    // Returns an invalid QDateTime if the value isn't an HTTP date.
+    static QDateTime fromHttpDate(QByteArray const& value);
+
+    MockTileServerConfig m_config;
+    QRandomGenerator m_random;
+    QRegularExpression m_pathPattern;
+    QTcpServer m_server;
+    std::map<QTcpSocket*, Connection> m_connections;
+    QTimer m_pacingTimer;
+    static constexpr int pacingIntervalMs = 10;
+    // Requests with headers larger than this are dropped.
+    static constexpr qsizetype maxRequestSize = 64 * 1024;
+};
+
+MockTileServer::MockTileServer(MockTileServerConfig const& config, quint32 seed) :
+    m_config{ config },
+    m_random{ seed }
+{
+    // Every placeholder only ever matches digits, which also keeps
+    // requests from reaching outside the root directory.
+    auto pattern = QRegularExpression::escape(m_config.pathTemplate);
+    for (auto const& placeholder : QStringList{ "z", "x", "y" }) {
+        pattern.replace(
+            QRegularExpression::escape(QString("{%1}").arg(placeholder)),
+            QString("(?<%1>\\d+)").arg(placeholder));
+    }
+    m_pathPattern.setPattern("^" + pattern + "$");
+
+    QObject::connect(&m_server, &QTcpServer::newConnection, &m_server, [this]() { handleNewConnections(); });
+
+    m_pacingTimer.setInterval(pacingIntervalMs);
+    m_pacingTimer.setTimerType(Qt::PreciseTimer);
+    QObject::connect(&m_pacingTimer, &QTimer::timeout, &m_server, [this]() { sendPacedBytes(); });
+}
+
+bool MockTileServer::listen(QHostAddress const& address, quint16 port)
+{
+    if (!m_server.listen(address, port)) {
+        qWarning() << "Unable to listen on" << address << port << ":" << m_server.errorString();
+        return false;
+    }
+    return true;
+}
+
+void MockTileServer::handleNewConnections()
+{
+    while (auto socket = m_server.nextPendingConnection()) {
+        m_connections.insert({ socket, {} });
+        QObject::connect(socket, &QTcpSocket::readyRead, &m_server, [this, socket]() {
+            auto it = m_connections.find(socket);
+            if (it == m_connections.end()) {
+                return;
+            }
+            it->second.received.append(socket->readAll());
+            handleNextRequest(socket);
+        });
+        QObject::connect(socket, &QTcpSocket::disconnected, &m_server, [this, socket]() {
+            m_connections.erase(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+void MockTileServer::handleNextRequest(QTcpSocket* socket)
+{
+    auto it = m_connections.find(socket);
+    if (it == m_connections.end() || it->second.busy) {
+        return;
+    }
+    auto& connection = it->second;
+
+    auto headerEnd = connection.received.indexOf("\r\n\r\n");
+    if (headerEnd < 0) {
+        if (connection.received.size() > maxRequestSize) {
+            socket->abort();
+        }
+        return;
+    }
+    auto requestBytes = connection.received.left(headerEnd);
+    connection.received.remove(0, headerEnd + 4);
+
+    auto lines = requestBytes.split('\n');
+    auto requestLine = lines.front().trimmed().split(' ');
+    if (requestLine.size() != 3) {
+        socket->abort();
+        return;
+    }
+    auto const& method = requestLine[0];
+    auto const& target = requestLine[1];
+    auto const& version = requestLine[2];
+
+    // Header names are case-insensitive.
+    std::map<QByteArray, QByteArray> headers;
+    for (qsizetype i = 1; i < lines.size(); i++) {
+        auto colon = lines[i].indexOf(':');
+        if (colon > 0) {
+            headers[lines[i].left(colon).trimmed().toLower()] = lines[i].mid(colon + 1).trimmed();
+        }
+    }
+
+    auto connectionHeader = headers["connection"].toLower();
+    connection.closeWhenSent =
+        connectionHeader == "close" ||
+        (version == "HTTP/1.0" && connectionHeader != "keep-alive");
+    connection.busy = true;
+
+    auto response = buildResponse(method, target, headers);
+    if (m_config.verbose) {
+        qInfo().noquote() << method << target << "->" << response.left(response.indexOf('\r'));
+    }
+
+    int delayMs = m_config.latencyMs;
+    if (m_config.jitterMs > 0) {
+        delayMs += m_random.bounded(m_config.jitterMs + 1);
+    }
+    // The socket is the context, so nothing fires for a connection that has gone away.
+    QTimer::singleShot(delayMs, socket, [this, socket, response]() {
+        queueResponse(socket, response);
+    });
+}
+
+QByteArray MockTileServer::buildResponse(
+    QByteArray const& method,
+    QByteArray const& target,
+    std::map<QByteArray, QByteArray> const& headers)
+{
+    auto path = QString::fromUtf8(target.left(target.indexOf('?')));
+    if (path.startsWith('/')) {
+        path.remove(0, 1);
+    }
+
+    // Responses to HEAD have the same headers as for GET, but never a body.
+    bool includeBody = method != "HEAD";
+    auto textResponse = [&](int status, QByteArray const& text) {
+        auto response = buildHeaders(status, {
+            { "Content-Type", "text/plain;charset=UTF-8" },
+            { "Content-Length", QByteArray::number(text.size()) } });
+        if (includeBody) {
+            response += text;
+        }
+        return response;
+    };
+
+    if (method != "GET" && method != "HEAD") {
+        return textResponse(405, "Only GET and HEAD are supported.");
+    }
+    if (!m_pathPattern.match(path).hasMatch()) {
+        return textResponse(404, "Not a tile path.");
+    }
+    if (m_config.errorRate > 0.0 && m_random.generateDouble() < m_config.errorRate) {
+        return textResponse(m_config.errorStatus, "Simulated failure.");
+    }
+
+    QFileInfo fileInfo { QDir{ m_config.rootPath }.filePath(path) };
+    if (!fileInfo.isFile()) {
+        return textResponse(404, "No such tile.");
+    }
+
+    auto lastModified = fileInfo.lastModified();
+    auto etag = QString("\"%1-%2\"")
+        .arg(fileInfo.size(), 0, 16)
+        .arg(lastModified.toMSecsSinceEpoch(), 0, 16)
+        .toLatin1();
+    std::vector<std::pair<QByteArray, QByteArray>> responseHeaders {
+        { "ETag", etag },
+        { "Last-Modified", toHttpDate(lastModified) },
+    };
+    if (m_config.maxAgeSecs >= 0) {
+        responseHeaders.push_back({ "Cache-Control", "max-age=" + QByteArray::number(m_config.maxAgeSecs) });
+    }
+
+    // If-Modified-Since only counts when there's no If-None-Match.
+    // HTTP dates have no fractional seconds, so neither does the comparison.
+    auto ifNoneMatch = headers.find("if-none-match");
+    auto ifModifiedSince = headers.find("if-modified-since");
+    if (ifNoneMatch != headers.end()) {
+        if (ifNoneMatch->second == etag) {
+            return buildHeaders(304, responseHeaders);
+        }
+    } else if (ifModifiedSince != headers.end()) {
+        auto since = fromHttpDate(ifModifiedSince->second);
+        if (since.isValid() && lastModified.toSecsSinceEpoch() <= since.toSecsSinceEpoch()) {
+            return buildHeaders(304, responseHeaders);
+        }
+    }
+
+    QFile file { fileInfo.filePath() };
+    if (!file.open(QFile::ReadOnly)) {
+        return textResponse(500, "Unable to read tile.");
+    }
+    auto body = file.readAll();
+
+    bool badContentType =
+        m_config.badContentTypeRate > 0.0 &&
+        m_random.generateDouble() < m_config.badContentTypeRate;
+    responseHeaders.push_back({ "Content-Type", badContentType ? "text/html" : m_config.contentType });
+    responseHeaders.push_back({ "Content-Length", QByteArray::number(body.size()) });
+    auto response = buildHeaders(200, responseHeaders);
+    if (includeBody) {
+        response += body;
+    }
+    return response;
+}
+
+void MockTileServer::queueResponse(QTcpSocket* socket, QByteArray const& response)
+{
+    auto it = m_connections.find(socket);
+    if (it == m_connections.end()) {
+        return;
+    }
+
+    if (m_config.bandwidthBytesPerSec <= 0) {
+        socket->write(response);
+        finishResponse(socket);
+        return;
+    }
+
+    it->second.unsent.append(response);
+    if (!m_pacingTimer.isActive()) {
+        m_pacingTimer.start();
+    }
+}
+
+void MockTileServer::sendPacedBytes()
+{
+    std::vector<QTcpSocket*> sending;
+    for (auto const& [socket, connection] : m_connections) {
+        if (!connection.unsent.isEmpty()) {
+            sending.push_back(socket);
+        }
+    }
+    if (sending.empty()) {
+        m_pacingTimer.stop();
+        return;
+    }
+
+    // The bandwidth is split evenly between the responses in progress.
+    auto budget = m_config.bandwidthBytesPerSec * pacingIntervalMs / 1000;
+    auto share = std::max<qint64>(budget / qint64(sending.size()), 1);
+    for (auto socket : sending) {
+        auto& unsent = m_connections.at(socket).unsent;
+        auto chunkSize = std::min<qint64>(share, unsent.size());
+        socket->write(unsent.constData(), chunkSize);
+        unsent.remove(0, chunkSize);
+        if (unsent.isEmpty()) {
+            finishResponse(socket);
+        }
+    }
+}
+
+void MockTileServer::finishResponse(QTcpSocket* socket)
+{
+    auto it = m_connections.find(socket);
+    if (it == m_connections.end()) {
+        return;
+    }
+    it->second.busy = false;
+    if (it->second.closeWhenSent) {
+        socket->disconnectFromHost();
+        return;
+    }
+    // The client might have sent the next request already.
+    handleNextRequest(socket);
+}
+
+QByteArray MockTileServer::buildHeaders(int status, std::vector<std::pair<QByteArray, QByteArray>> const& headers)
+{
+    static std::map<int, QByteArray> const reasonPhrases {
+        { 200, "OK" },
+        { 304, "Not Modified" },
+        { 404, "Not Found" },
+        { 405, "Method Not Allowed" },
+        { 429, "Too Many Requests" },
+        { 500, "Internal Server Error" },
+        { 502, "Bad Gateway" },
+        { 503, "Service Unavailable" },
+        { 504, "Gateway Timeout" },
+    };
+    auto reasonIt = reasonPhrases.find(status);
+    auto reasonPhrase = reasonIt != reasonPhrases.end() ? reasonIt->second : QByteArray{ "Error" };
+
+    QByteArray bytes = "HTTP/1.1 " + QByteArray::number(status) + " " + reasonPhrase + "\r\n";
+    for (auto const& [name, value] : headers) {
+        bytes += name + ": " + value + "\r\n";
+    }
+    if (status == 304) {
+        bytes += "Content-Length: 0\r\n";
+    }
+    bytes += "\r\n";
+    return bytes;
+}
+
+QByteArray MockTileServer::toHttpDate(QDateTime const& dateTime)
+{
+    return QLocale::c().toString(dateTime.toUTC(), "ddd, dd MMM yyyy hh:mm:ss 'GMT'").toLatin1();
+}
+
+QDateTime MockTileServer::fromHttpDate(QByteArray const& value)
+{
+    auto dateTime = QLocale::c().toDateTime(QString::fromLatin1(value), "ddd, dd MMM yyyy hh:mm:ss 'GMT'");
+    if (!dateTime.isValid()) {
+        return {};
+    }
+    return QDateTime{ dateTime.date(), dateTime.time(), QTimeZone::utc() };
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("mock_tile_server");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+        "Serves vector tiles from a directory, simulating the latency, bandwidth "
+        "and failures of a real tile server.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("root", "Directory containing the tiles.");
+
+    QCommandLineOption hostOption { "host", "Address to listen on.", "address", "127.0.0.1" };
+    QCommandLineOption portOption { "port", "Port to listen on, 0 picks a free one.", "port", "8080" };
+    QCommandLineOption pathTemplateOption {
+        "path-template",
+        "Path of a tile relative to the root directory and the URL.",
+        "template",
+        "{z}/{x}/{y}.mvt" };
+    QCommandLineOption latencyOption { "latency", "Delay before every response.", "ms", "0" };
+    QCommandLineOption jitterOption { "jitter", "Random extra delay of up to this much.", "ms", "0" };
+    QCommandLineOption bandwidthOption {
+        "bandwidth",
+        "Bandwidth shared by all connections, 0 for unlimited.",
+        "kbit/s",
+        "0" };
+    QCommandLineOption errorRateOption { "error-rate", "Fraction of requests that fail.", "fraction", "0" };
+    QCommandLineOption errorStatusOption { "error-status", "HTTP status of failed requests.", "status", "503" };
+    QCommandLineOption contentTypeOption {
+        "content-type",
+        "Content type of tiles.",
+        "type",
+        "application/x-protobuf" };
+    QCommandLineOption badContentTypeRateOption {
+        "bad-content-type-rate",
+        "Fraction of tiles sent as text/html instead.",
+        "fraction",
+        "0" };
+    QCommandLineOption maxAgeOption {
+        "max-age",
+        "Cache-Control max-age of tiles, -1 to leave it out.",
+        "seconds",
+        "-1" };
+    QCommandLineOption seedOption { "seed", "Seed for the simulated failures, random if not set.", "seed" };
+    QCommandLineOption verboseOption { "verbose", "Print every request." };
+    parser.addOptions({
+        hostOption,
+        portOption,
+        pathTemplateOption,
+        latencyOption,
+        jitterOption,
+        bandwidthOption,
+        errorRateOption,
+        errorStatusOption,
+        contentTypeOption,
+        badContentTypeRateOption,
+        maxAgeOption,
+        seedOption,
+        verboseOption });
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+
+    MockTileServerConfig config;
+    config.rootPath = parser.positionalArguments().front();
+    config.pathTemplate = parser.value(pathTemplateOption);
+    config.latencyMs = std::max(parser.value(latencyOption).toInt(), 0);
+    config.jitterMs = std::max(parser.value(jitterOption).toInt(), 0);
+    config.bandwidthBytesPerSec = std::max(parser.value(bandwidthOption).toLongLong(), qint64(0)) * 1000 / 8;
+    config.errorRate = parser.value(errorRateOption).toDouble();
+    config.errorStatus = parser.value(errorStatusOption).toInt();
+    config.contentType = parser.value(contentTypeOption).toLatin1();
+    config.badContentTypeRate = parser.value(badContentTypeRateOption).toDouble();
+    config.maxAgeSecs = parser.value(maxAgeOption).toInt();
+    config.verbose = parser.isSet(verboseOption);
+
+    if (!QFileInfo{ config.rootPath }.isDir()) {
+        qWarning() << "No such directory:" << config.rootPath;
+        return 1;
+    }
+
+    auto seed = parser.isSet(seedOption)
+        ? parser.value(seedOption).toUInt()
+        : QRandomGenerator::global()->generate();
+
+    MockTileServer server { config, seed };
+    QHostAddress address { parser.value(hostOption) };
+    if (!server.listen(address, quint16(parser.value(portOption).toUInt()))) {
+        return 1;
+    }
+
+    auto host = address.protocol() == QAbstractSocket::IPv6Protocol
+        ? "[" + address.toString() + "]"
+        : address.toString();
+    qInfo().noquote() << "Serving" << config.rootPath << "with seed" << seed;
+    qInfo().noquote() << QString("TILE_SOURCE_URL=http://%1:%2/%3")
+        .arg(host)
+        .arg(server.serverPort())
+        .arg(config.pathTemplate);
+
+    return app.exec();
+}
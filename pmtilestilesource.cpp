@@ -0,0 +1,323 @@
+#include "pmtilestilesource.h"
+
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    constexpr int pmTilesHeaderSize = 127;
+
+    // Compression identifiers used in the header.
+    constexpr quint8 pmTilesCompressionNone = 1;
+    constexpr quint8 pmTilesCompressionGzip = 2;
+
+    constexpr quint8 pmTilesTileTypeMvt = 1;
+
+    // The spec allows leaf directories to point to other leaf directories,
+    // but real archives never go deeper than this.
+    constexpr int pmTilesMaxDirectoryDepth = 4;
+
+    // Reads an unsigned LEB128 varint. Returns false on truncated or oversized input.
+    bool readVarint(uchar const*& it, uchar const* end, quint64& outValue)
+    {
+        outValue = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (it == end) {
+                return false;
+            }
+            uchar byte = *it++;
+            outValue |= quint64(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+PmTilesTileSource::PmTilesTileSource(QObject* parent) : TileSource{ parent } {}
+
+QString PmTilesTileSource::getPath() const
+{
+    auto autoLock = std::lock_guard{ *_propertiesLock };
+    return m_path;
+}
+
+void PmTilesTileSource::setPath(QString const& newValue)
+{
+    bool changed = false;
+    {
+        auto autoLock = std::lock_guard{ *_propertiesLock };
+        changed = newValue != m_path;
+        m_path = newValue;
+    }
+    if (changed) {
+        emit pathChanged();
+    }
+}
+
+quint64 PmTilesTileSource::tileCoordToTileId(TileCoord coord)
+{
+    // All the tiles of the lower zoom levels come first.
+    // That's 4^0 + 4^1 + ... + 4^(level-1) tiles.
+    quint64 tileId = ((quint64(1) << (2 * coord.level)) - 1) / 3;
+
+    // Then the position along the Hilbert curve at this zoom level.
+    quint64 n = quint64(1) << coord.level;
+    quint64 x = coord.x;
+    quint64 y = coord.y;
+    for (quint64 s = n / 2; s > 0; s /= 2) {
+        quint64 rx = (x & s) > 0 ? 1 : 0;
+        quint64 ry = (y & s) > 0 ? 1 : 0;
+        tileId += s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve lines up with the next level.
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return tileId;
+}
+
+bool PmTilesTileSource::openArchive()
+{
+    m_file.setFileName(getPath());
+    if (!m_file.open(QFile::ReadOnly)) {
+        qWarning() << "Unable to open PMTiles archive" << getPath() << ":" << m_file.errorString();
+        return false;
+    }
+
+    m_mappingSize = m_file.size();
+    m_mapping = m_file.map(0, m_mappingSize);
+    if (m_mapping == nullptr) {
+        qWarning() << "Unable to map PMTiles archive" << getPath() << ":" << m_file.errorString();
+        return false;
+    }
+
+    if (m_mappingSize < pmTilesHeaderSize ||
+        std::memcmp(m_mapping, "PMTiles", 7) != 0 ||
+        m_mapping[7] != 3)
+    {
+        qWarning() << "Not a PMTiles v3 archive:" << getPath();
+        return false;
+    }
+
+    auto readU64 = [&](int offset) { return qFromLittleEndian<quint64>(m_mapping + offset); };
+    quint64 rootDirectoryOffset = readU64(8);
+    quint64 rootDirectoryLength = readU64(16);
+    m_leafDirectoriesOffset = readU64(40);
+    m_tileDataOffset = readU64(56);
+    m_internalCompression = m_mapping[97];
+    m_tileCompression = m_mapping[98];
+    quint8 tileType = m_mapping[99];
+
+    if (tileType != pmTilesTileTypeMvt) {
+        qWarning() << "PMTiles archive doesn't contain vector tiles:" << getPath();
+        return false;
+    }
+    bool supportedCompression =
+        (m_internalCompression == pmTilesCompressionNone || m_internalCompression == pmTilesCompressionGzip) &&
+        (m_tileCompression == pmTilesCompressionNone || m_tileCompression == pmTilesCompressionGzip);
+    if (!supportedCompression) {
+        qWarning() << "PMTiles archive uses an unsupported compression:" << getPath();
+        return false;
+    }
+
+    auto rootDirectoryOpt = parseDirectory(rootDirectoryOffset, rootDirectoryLength);
+    if (!rootDirectoryOpt.has_value()) {
+        qWarning() << "PMTiles archive has a corrupt root directory:" << getPath();
+        return false;
+    }
+    m_rootDirectory = std::move(rootDirectoryOpt.value());
+
+    return true;
+}
+
+std::optional<PmTilesTileSource::Directory> PmTilesTileSource::parseDirectory(
+    quint64 offset,
+    quint64 length) const
+{
+    if (offset > m_mappingSize || length > m_mappingSize - offset) {
+        return std::nullopt;
+    }
+
+    // Uncompressed directories are parsed straight out of the mapping.
+    auto rawBytes = QByteArray::fromRawData(
+        reinterpret_cast<char const*>(m_mapping + offset),
+        qsizetype(length));
+    QByteArray bytes;
+    if (m_internalCompression == pmTilesCompressionGzip) {
+        auto bytesOpt = decompressTileBytesIfGzipped(rawBytes);
+        if (!bytesOpt.has_value()) {
+            return std::nullopt;
+        }
+        bytes = std::move(bytesOpt.value());
+    } else {
+        bytes = rawBytes;
+    }
+
+    auto it = reinterpret_cast<uchar const*>(bytes.constData());
+    auto end = it + bytes.size();
+
+    quint64 entryCount = 0;
+    if (!readVarint(it, end, entryCount) || entryCount > quint64(bytes.size())) {
+        return std::nullopt;
+    }
+
+    // The entries are stored column by column.
+    Directory directory(entryCount);
+    quint64 lastTileId = 0;
+    for (auto& entry : directory) {
+        quint64 delta = 0;
+        if (!readVarint(it, end, delta)) {
+            return std::nullopt;
+        }
+        lastTileId += delta;
+        entry.tileId = lastTileId;
+    }
+    for (auto& entry : directory) {
+        quint64 value = 0;
+        if (!readVarint(it, end, value)) {
+            return std::nullopt;
+        }
+        entry.runLength = quint32(value);
+    }
+    for (auto& entry : directory) {
+        quint64 value = 0;
+        if (!readVarint(it, end, value)) {
+            return std::nullopt;
+        }
+        entry.length = quint32(value);
+    }
+    for (size_t i = 0; i < directory.size(); i++) {
+        quint64 value = 0;
+        if (!readVarint(it, end, value)) {
+            return std::nullopt;
+        }
+        // An offset of 0 means the entry comes right after the previous one.
+        if (value == 0 && i > 0) {
+            directory[i].offset = directory[i - 1].offset + directory[i - 1].length;
+        } else {
+            directory[i].offset = value - 1;
+        }
+    }
+
+    return directory;
+}
+
+std::shared_ptr<PmTilesTileSource::Directory const> PmTilesTileSource::getLeafDirectory(
+    quint64 offset,
+    quint64 length)
+{
+    {
+        auto autoLock = std::lock_guard{ *_leafDirectoriesLock };
+        auto it = m_leafDirectories.find(offset);
+        if (it != m_leafDirectories.end()) {
+            return it->second;
+        }
+    }
+
+    // Parse outside the lock, another thread might end up
+    // parsing the same directory but that's harmless.
+    auto directoryOpt = parseDirectory(m_leafDirectoriesOffset + offset, length);
+    if (!directoryOpt.has_value()) {
+        return nullptr;
+    }
+    auto directory = std::make_shared<Directory const>(std::move(directoryOpt.value()));
+
+    auto autoLock = std::lock_guard{ *_leafDirectoriesLock };
+    // Leaf directories are only a few kilobytes each and the viewport only
+    // touches a handful at a time, so starting over when full is good enough.
+    if (m_leafDirectories.size() >= maxCachedLeafDirectories) {
+        m_leafDirectories.clear();
+    }
+    m_leafDirectories.insert({ offset, directory });
+    return directory;
+}
+
+void PmTilesTileSource::fetchTile(TileCoord coord, FetchCallback callback)
+{
+    std::call_once(m_openOnce, [this]() { m_isOpen = openArchive(); });
+
+    TileFetchResult result;
+    if (!m_isOpen) {
+        result.status = TileFetchResult::Status::Error;
+        result.errorString = "Unable to open PMTiles archive.";
+        callback(std::move(result));
+        return;
+    }
+
+    auto tileId = tileCoordToTileId(coord);
+
+    // Holds on to the leaf directory we're currently searching.
+    std::shared_ptr<Directory const> leafDirectory;
+    Directory const* directory = &m_rootDirectory;
+    for (int depth = 0; depth < pmTilesMaxDirectoryDepth; depth++) {
+        // Find the last entry that starts at or before our tile.
+        auto entryIt = std::upper_bound(
+            directory->begin(),
+            directory->end(),
+            tileId,
+            [](quint64 tileId, DirectoryEntry const& entry) { return tileId < entry.tileId; });
+        if (entryIt == directory->begin()) {
+            break;
+        }
+        auto const& entry = *std::prev(entryIt);
+
+        if (entry.runLength == 0) {
+            // This entry points to a leaf directory that might contain our tile.
+            leafDirectory = getLeafDirectory(entry.offset, entry.length);
+            if (leafDirectory == nullptr) {
+                result.status = TileFetchResult::Status::Error;
+                result.errorString = "PMTiles archive has a corrupt leaf directory.";
+                callback(std::move(result));
+                return;
+            }
+            directory = leafDirectory.get();
+            continue;
+        }
+
+        if (tileId >= entry.tileId + entry.runLength) {
+            break;
+        }
+
+        quint64 tileOffset = m_tileDataOffset + entry.offset;
+        if (tileOffset > m_mappingSize || entry.length > m_mappingSize - tileOffset) {
+            result.status = TileFetchResult::Status::Error;
+            result.errorString = "PMTiles archive points to a tile outside the file.";
+            callback(std::move(result));
+            return;
+        }
+
+        // The mapping lives as long as this source. The TileLoader only deletes
+        // the source once the jobs that can hold on to these bytes are done,
+        // and the disk cache never sees them since this source isn't cacheable.
+        auto tileBytes = QByteArray::fromRawData(
+            reinterpret_cast<char const*>(m_mapping + tileOffset),
+            qsizetype(entry.length));
+        if (m_tileCompression == pmTilesCompressionGzip) {
+            auto bytesOpt = decompressTileBytesIfGzipped(tileBytes);
+            if (!bytesOpt.has_value()) {
+                result.status = TileFetchResult::Status::Error;
+                result.errorString = "Unable to decompress tile from PMTiles archive.";
+                callback(std::move(result));
+                return;
+            }
+            tileBytes = std::move(bytesOpt.value());
+        }
+
+        result.status = TileFetchResult::Status::Success;
+        result.bytes = std::move(tileBytes);
+        callback(std::move(result));
+        return;
+    }
+
+    result.status = TileFetchResult::Status::NotFound;
+    result.errorString = "Tile is not in the PMTiles archive.";
+    callback(std::move(result));
+}
@@ -0,0 +1,98 @@
+#ifndef PMTILESTILESOURCE_H
+#define PMTILESTILESOURCE_H
+
+#include "tilesource.h"
+
+#include <QFile>
+#include <QString>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Reads tiles out of a PMTiles v3 archive.
+//
+// The whole archive is memory-mapped when the first tile is fetched.
+// The root directory is parsed once up front, and leaf directories are
+// parsed on demand and cached. Uncompressed tiles are handed out as
+// views straight into the mapping, without copying them.
+//
+// See https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md
+class PmTilesTileSource : public TileSource
+{
+    Q_OBJECT
+    Q_PROPERTY(
+        QString path
+        READ getPath
+        WRITE setPath
+        NOTIFY pathChanged)
+
+public:
+    explicit PmTilesTileSource(QObject* parent = nullptr);
+
+    // Path to the .pmtiles file.
+    //
+    // Must be set before the TileLoader starts requesting tiles.
+    QString getPath() const;
+    void setPath(QString const& newValue);
+
+    // The tile is looked up on the calling thread, which is
+    // one of the TileLoader's I/O threads.
+    void fetchTile(TileCoord coord, FetchCallback callback) override;
+    bool isCacheable() const override { return false; }
+    QString getCacheName() const override { return "pmtiles"; }
+
+    // Maps a tile coordinate onto its position along the Hilbert curve,
+    // which is what the archive is indexed by.
+    static quint64 tileCoordToTileId(TileCoord coord);
+
+private:
+    struct DirectoryEntry {
+        quint64 tileId = 0;
+        // Relative to the start of the tile data section for tiles,
+        // and to the start of the leaf directory section for leaf directories.
+        quint64 offset = 0;
+        quint32 length = 0;
+        // 0 means this entry points to a leaf directory.
+        quint32 runLength = 0;
+    };
+    using Directory = std::vector<DirectoryEntry>;
+
+    // Maps the archive and parses the header and the root directory.
+    // Returns false if the archive couldn't be opened.
+    bool openArchive();
+
+    // Decompresses and parses the directory at the given location in the archive.
+    std::optional<Directory> parseDirectory(quint64 offset, quint64 length) const;
+    // Returns a cached leaf directory, parsing it if needed.
+    std::shared_ptr<Directory const> getLeafDirectory(quint64 offset, quint64 length);
+
+    // IMPORTANT: This variable is ONLY available when _propertiesLock is locked.
+    QString m_path;
+    std::unique_ptr<std::mutex> _propertiesLock = std::make_unique<std::mutex>();
+
+    // These are written once by openArchive, and are read-only afterwards.
+    std::once_flag m_openOnce;
+    bool m_isOpen = false;
+    QFile m_file;
+    uchar const* m_mapping = nullptr;
+    quint64 m_mappingSize = 0;
+    quint64 m_leafDirectoriesOffset = 0;
+    quint64 m_tileDataOffset = 0;
+    quint8 m_internalCompression = 0;
+    quint8 m_tileCompression = 0;
+    Directory m_rootDirectory;
+
+    // Keyed by the offset of the leaf directory.
+    // IMPORTANT: This variable is ONLY available when _leafDirectoriesLock is locked.
+    std::map<quint64, std::shared_ptr<Directory const>> m_leafDirectories;
+    std::unique_ptr<std::mutex> _leafDirectoriesLock = std::make_unique<std::mutex>();
+    static constexpr int maxCachedLeafDirectories = 256;
+
+signals:
+    void pathChanged();
+};
+
+#endif // PMTILESTILESOURCE_H
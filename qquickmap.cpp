@@ -162,14 +162,18 @@ public:
     struct UniformType {
         float matrix[16] = {};
         float color[4] = { 0, 0, 0, 1.0 };
+        // The area of the tile to draw, in normalized tile coordinates.
+        // Stored as (minX, minY, maxX, maxY).
+        float clipRect[4] = { 0, 0, 1, 1 };
 
-        static constexpr int internalSize = 64 + 16;
+        static constexpr int internalSize = 64 + 16 + 16;
         // Dynamic uniform buffers need stride to be multiple of
         // 256 bytes for now...
-        char _padding2[256 - 80] = {};
+        char _padding2[256 - internalSize] = {};
     };
     static_assert(sizeof(UniformType) == 256);
     static_assert(offsetof(UniformType, color) == 64);
+    static_assert(offsetof(UniformType, clipRect) == 80);
 
     std::vector<UniformType> m_uniforms = {};
     class DrawCmd {
@@ -386,6 +390,8 @@ QQuickMap::QQuickMap(QQuickItem* parent) : QQuickItem(parent) {
 }
 
 QSGNode* QQuickMap::updatePaintNode(QSGNode* oldNode, UpdatePaintNodeData*) {
+    updateViewportMotion();
+
     auto node = oldNode;
     if (oldNode == nullptr) {
         node = new MyCustomRenderNode(window(), this);
@@ -615,7 +621,7 @@ void MyCustomRenderNode::prepareDrawCommands(
 
     // This needs to be clamped based on the StyleSheeet min-max zoom?
     auto mapZoom = (int)std::round(vpZoom);
-    mapZoom = std::clamp(mapZoom, 0, 15);
+    mapZoom = std::clamp(mapZoom, 0, TileLoader::maxZoomLevel);
 
     if (tileLoader == nullptr) {
         return;
@@ -629,16 +635,20 @@ void MyCustomRenderNode::prepareDrawCommands(
         mapZoom);
 
     // This is a memory leak.
-    auto* tileRequestResult = tileLoader->requestTiles(visibleCoords);
+    auto* tileRequestResult = tileLoader->requestTiles(visibleCoords, true);
     tileLoaderRequestResult.reset(tileRequestResult);
 
-    for (auto const tileCoord : visibleCoords) {
-        // Check if this tile-coord is loaded.
-        auto tileIt = tileRequestResult->tiles.find(tileCoord);
-        if (tileIt == tileRequestResult->tiles.end()) {
-            continue;
-        }
-        auto const& tile = *tileIt->second;
+    // Adds the draw commands for a single tile. Only the area covered by
+    // clipCoord gets drawn, which must be the tile itself or one of its descendants.
+    auto addTileDrawCmds = [&](
+        TileLoader::StoredTile const& tile,
+        TileCoord tileCoord,
+        TileCoord clipCoord)
+    {
+        int clipLevelDiff = clipCoord.level - tileCoord.level;
+        float clipSize = 1.f / (1 << clipLevelDiff);
+        float clipMinX = (clipCoord.x - (tileCoord.x << clipLevelDiff)) * clipSize;
+        float clipMinY = (clipCoord.y - (tileCoord.y << clipLevelDiff)) * clipSize;
 
         for (auto const& abstractLayerStylePtr : m_styleSheet.m_layerStyles) {
             if (abstractLayerStylePtr->type() != StyleSheet::LayerType::fill) {
@@ -694,8 +704,15 @@ void MyCustomRenderNode::prepareDrawCommands(
                 // TODO! There is a bug here!! Things are not being blended correctly!!
                 test.color[3] = color.alphaF();
 
+                test.clipRect[0] = clipMinX;
+                test.clipRect[1] = clipMinY;
+                test.clipRect[2] = clipMinX + clipSize;
+                test.clipRect[3] = clipMinY + clipSize;
+
                 {
-                    auto quadScale = 1 / std::powf(2, mapZoom);
+                    // Fallback tiles are not necessarily on the
+                    // same zoom level as the map.
+                    auto quadScale = 1 / std::powf(2, tileCoord.level);
 
                     auto mat = glm::mat4{ 1.f };
 
@@ -703,8 +720,8 @@ void MyCustomRenderNode::prepareDrawCommands(
                     mat = glm::scale(glm::mat4{1.f}, { quadScale, quadScale, 1 }) * mat;
                     // Move origin to top left
                     mat = glm::translate(glm::mat4{ 1.f }, glm::vec3{
-                        -(std::pow(2, mapZoom)-1) / 2,
-                        (std::pow(2, mapZoom)-1) / 2,
+                        -(std::pow(2, tileCoord.level)-1) / 2,
+                        (std::pow(2, tileCoord.level)-1) / 2,
                         0 } * quadScale) *
                         mat;
 
@@ -760,6 +777,58 @@ void MyCustomRenderNode::prepareDrawCommands(
                 m_drawCmds.push_back(cmd);
             }
         }
+    };
+
+    for (auto const tileCoord : visibleCoords) {
+        // Check if this tile-coord is loaded.
+        auto tileIt = tileRequestResult->tiles.find(tileCoord);
+        if (tileIt != tileRequestResult->tiles.end()) {
+            addTileDrawCmds(*tileIt->second, tileCoord, tileCoord);
+            continue;
+        }
+
+        // If not, draw whatever loaded tiles we have covering the same area
+        // until the actual tile is ready.
+        auto fallbackIt = tileRequestResult->fallbacks.find(tileCoord);
+        if (fallbackIt != tileRequestResult->fallbacks.end()) {
+            for (auto const& fallback : fallbackIt->second) {
+                addTileDrawCmds(*fallback.tile, fallback.coord, fallback.clipTo);
+            }
+        }
+    }
+}
+
+void QQuickMap::updateViewportMotion()
+{
+    // If there's been a long pause since the last frame,
+    // the viewport is considered to have been standing still.
+    constexpr qint64 maxSampleIntervalMs = 250;
+    // How much of the previous velocity is kept on each new sample.
+    // This smooths out the jitter from uneven frame times.
+    constexpr double smoothing = 0.5;
+
+    if (!m_motionTimer.isValid()) {
+        m_motionTimer.start();
+    } else {
+        qint64 elapsedMs = m_motionTimer.restart();
+        if (elapsedMs > maxSampleIntervalMs) {
+            m_viewportMotion = {};
+        } else if (elapsedMs > 0) {
+            double elapsedSeconds = elapsedMs / 1000.0;
+            auto sample = [&](double previous, double delta) {
+                return previous * smoothing + (delta / elapsedSeconds) * (1 - smoothing);
+            };
+            m_viewportMotion.velocityX = sample(m_viewportMotion.velocityX, m_viewportX - m_lastMotionX);
+            m_viewportMotion.velocityY = sample(m_viewportMotion.velocityY, m_viewportY - m_lastMotionY);
+            m_viewportMotion.zoomVelocity = sample(m_viewportMotion.zoomVelocity, m_viewportZoom - m_lastMotionZoom);
+        }
+    }
+    m_lastMotionX = m_viewportX;
+    m_lastMotionY = m_viewportY;
+    m_lastMotionZoom = m_viewportZoom;
+
+    if (m_tileLoader != nullptr) {
+        m_tileLoader->setViewportMotion(m_viewportMotion);
     }
 }
 
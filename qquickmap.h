@@ -2,6 +2,7 @@
 #define QQUICKMAP_H
 
 #include <QQuickItem>
+#include <QElapsedTimer>
 
 #include "tileloader.h"
 
@@ -153,9 +154,9 @@ public:
 
         QObject::connect(
             m_tileLoader,
-            &TileLoader::tileLoaded,
+            &TileLoader::tilesLoaded,
             this,
-            [=](bool success, TileCoord tile) {
+            [=](QList<TileCoord> const& loadedTiles, QList<TileCoord> const& failedTiles) {
                 this->update();
             });
         if (changed) {
@@ -185,6 +186,10 @@ protected:
     std::unique_ptr<RhiStuffPimplT> rhiStuff;
     RhiStuffImpl* getRhiStuff();
 
+    // Measures how fast the viewport is moving since the last call,
+    // and passes it on to the TileLoader so it can prefetch tiles.
+    void updateViewportMotion();
+
 private:
     double m_viewportZoom = 0;
     // Center of viewport X
@@ -198,6 +203,13 @@ private:
     // Range [0, 360]
     double m_viewportRotation = 0;
 
+    // Used to measure the velocity of the viewport between frames.
+    QElapsedTimer m_motionTimer;
+    double m_lastMotionX = 0;
+    double m_lastMotionY = 0;
+    double m_lastMotionZoom = 0;
+    ViewportMotion m_viewportMotion;
+
     // The RenderNode needs to store a TileLoader request result
     // during the 'prepare' stage AND the 'render' stage. And then
     // destroy that result when the QtQuick Scene Graph command buffer
@@ -207,7 +219,7 @@ private:
     //
     // This is to signal
     // to the TileLoader that the tiles are now ready to be cleaned up
-    // by the tile eviction policy (Not yet implemented.
+    // by the tile eviction policy.
     TileLoader* m_tileLoader = nullptr;
 
 signals:
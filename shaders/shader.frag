@@ -3,6 +3,9 @@
 layout(column_major, std140, binding = 0) uniform buf {
     mat4 matrix;
     vec4 color;
+    // The area of the tile to draw, in normalized tile coordinates.
+    // Stored as (minX, minY, maxX, maxY).
+    vec4 clipRect;
 };
 
 layout(location = 0) out vec4 fragColor;
@@ -10,8 +13,8 @@ layout(location = 0) out vec4 fragColor;
 layout(location = 0) in vec2 normalizedPos;
 
 void main() {
-    if (normalizedPos.x < 0 || normalizedPos.x > 1 ||
-        normalizedPos.y < 0 || normalizedPos.y > 1)
+    if (normalizedPos.x < clipRect.x || normalizedPos.x > clipRect.z ||
+        normalizedPos.y < clipRect.y || normalizedPos.y > clipRect.w)
     {
         discard;
     }
@@ -6,6 +6,7 @@ layout(location = 0) in vec2 positionIn;
 layout(column_major, std140, binding = 0) uniform UniformBuff {
     mat4 matrix;
     vec4 color;
+    vec4 clipRect;
 };
 
 layout(location = 0) out vec2 normalizedPos;
@@ -0,0 +1,1224 @@
+#include "tilediskcache.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+
+#include <zlib.h>
+
+#if defined(Q_OS_WINDOWS)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef TILE_CACHE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+namespace {
+    // Every record in a segment file starts with this header.
+    //
+    //  0: u32 magic
+    //  4: u8  kind
+    //  5: u8  flags, followed by 2 bytes of padding
+    //  8: u64 packed tile coord
+    // 16: i64 time written, in seconds since epoch
+    // 24: u32 payload length
+    // 28: u32 CRC-32 of the payload
+    constexpr int recordHeaderSize = 32;
+    constexpr quint32 recordMagic = 0x31524354; // "TCR1"
+    // The payload is a zstd frame. It might need the dictionary of the cache.
+    constexpr quint8 recordFlagZstd = 0x1;
+    // The payload starts with a u32 length and that many bytes of metadata,
+    // followed by the bytes of the entry. Only the latter are compressed.
+    constexpr quint8 recordFlagMetadata = 0x2;
+
+    constexpr quint32 indexMagic = 0x58444954; // "TIDX"
+    // Version 2 added the access stats.
+    constexpr quint32 indexVersion = 2;
+
+    // When picking which entries to evict, every doubling of the
+    // amount of reads counts as much as having been read this much later.
+    constexpr qint64 evictionSecsPerAccessDoubling = 24 * 60 * 60;
+    // Eviction keeps going until the cache is this far below budget,
+    // so that it doesn't have to run again right away.
+    constexpr double evictionTargetFraction = 0.9;
+
+    // A dictionary is trained once the cache holds this many tiles,
+    // using at most maxDictionarySamples of them.
+    constexpr int minDictionarySamples = 256;
+    constexpr int maxDictionarySamples = 4096;
+    constexpr qsizetype maxDictionarySampleBytes = 16 * 1024 * 1024;
+    // The size zstd recommends for dictionaries.
+    constexpr qsizetype maxDictionarySize = 112 * 1024;
+    constexpr int zstdCompressionLevel = 6;
+    // Anything claiming to decompress into more than this is corrupt.
+    constexpr quint64 maxDecompressedSize = 64 * 1024 * 1024;
+
+    quint32 calcChecksum(char const* data, qsizetype length)
+    {
+        return quint32(crc32(0, reinterpret_cast<Bytef const*>(data), uInt(length)));
+    }
+
+    struct RecordHeader {
+        TileDiskCache::EntryKind kind = {};
+        quint8 flags = 0;
+        quint64 packedKey = 0;
+        qint64 writtenAtSecs = 0;
+        quint32 length = 0;
+        quint32 checksum = 0;
+    };
+
+    void writeRecordHeader(char* out, RecordHeader const& header)
+    {
+        std::memset(out, 0, recordHeaderSize);
+        qToLittleEndian<quint32>(recordMagic, out);
+        out[4] = char(header.kind);
+        out[5] = char(header.flags);
+        qToLittleEndian<quint64>(header.packedKey, out + 8);
+        qToLittleEndian<qint64>(header.writtenAtSecs, out + 16);
+        qToLittleEndian<quint32>(header.length, out + 24);
+        qToLittleEndian<quint32>(header.checksum, out + 28);
+    }
+
+    std::optional<RecordHeader> readRecordHeader(char const* in)
+    {
+        if (qFromLittleEndian<quint32>(in) != recordMagic) {
+            return std::nullopt;
+        }
+        RecordHeader header;
+        header.kind = TileDiskCache::EntryKind(in[4]);
+        header.flags = quint8(in[5]);
+        header.packedKey = qFromLittleEndian<quint64>(in + 8);
+        header.writtenAtSecs = qFromLittleEndian<qint64>(in + 16);
+        header.length = qFromLittleEndian<quint32>(in + 24);
+        header.checksum = qFromLittleEndian<quint32>(in + 28);
+        bool validKind =
+            header.kind == TileDiskCache::EntryKind::Tile ||
+            header.kind == TileDiskCache::EntryKind::Missing ||
+            header.kind == TileDiskCache::EntryKind::Removed;
+        if (!validKind) {
+            return std::nullopt;
+        }
+        return header;
+    }
+}
+
+class TileDiskCache::Segment {
+public:
+    quint32 id = 0;
+    QString path;
+    QFile file;
+    // The whole file is mapped once the segment is sealed and no longer written to.
+    // Null for the active segment.
+    uchar* mapping = nullptr;
+    // The amount of bytes that hold valid records.
+    qint64 size = 0;
+    // The amount of bytes that hold records that have been superseded.
+    qint64 deadBytes = 0;
+    // Set by compaction. The file is deleted once the last reader lets go of it.
+    bool deleteWhenReleased = false;
+    // True if records have been written since the file was last synced to disk.
+    bool needsSync = false;
+
+    ~Segment() {
+        if (mapping != nullptr) {
+            file.unmap(mapping);
+        }
+        file.close();
+        if (deleteWhenReleased) {
+            QFile::remove(path);
+        }
+    }
+};
+
+class TileDiskCache::Shard {
+public:
+    int index = 0;
+    std::once_flag openOnce;
+
+    struct IndexEntry {
+        quint32 segmentId = 0;
+        // Offset of the record header in the segment file.
+        qint64 offset = 0;
+        quint32 length = 0;
+        EntryKind kind = EntryKind::Tile;
+        qint64 writtenAtSecs = 0;
+        // Used to decide what to evict.
+        qint64 lastAccessSecs = 0;
+        quint32 accessCount = 0;
+    };
+
+    // Set once the index has been loaded, after which it never changes.
+    std::atomic<bool> isOpen = false;
+
+    std::mutex lock;
+    // IMPORTANT: These variables are ONLY available when lock is locked.
+    std::unordered_map<quint64, IndexEntry> entries;
+    std::map<quint32, std::shared_ptr<Segment>> segments;
+    // The segment that new records are appended to. Always the last one in segments.
+    std::shared_ptr<Segment> activeSegment;
+    quint32 nextSegmentId = 0;
+    int changesSinceSave = 0;
+    // True if access stats have changed since last save. These alone
+    // don't warrant saving the index, so they wait for the next save.
+    bool accessStatsChanged = false;
+
+    // Serializes writing of the index file.
+    std::mutex saveLock;
+};
+
+static QString segmentFilePath(QString const& directory, int shardIndex, quint32 segmentId)
+{
+    return QDir::cleanPath(directory + QDir::separator() + QString("s%1_%2.seg").arg(shardIndex).arg(segmentId));
+}
+
+static QString indexFilePath(QString const& directory, int shardIndex)
+{
+    return QDir::cleanPath(directory + QDir::separator() + QString("s%1.index").arg(shardIndex));
+}
+
+static QString dictionaryFilePath(QString const& directory)
+{
+    return QDir::cleanPath(directory + QDir::separator() + "zstd.dict");
+}
+
+class TileDiskCache::CompressionDictionary {
+public:
+    // Returns null if the dictionary is invalid, or zstd support isn't built in.
+    static std::shared_ptr<CompressionDictionary const> create(QByteArray const& bytes)
+    {
+#ifdef TILE_CACHE_ZSTD
+        auto dictionary = std::make_shared<CompressionDictionary>();
+        dictionary->id = ZDICT_getDictID(bytes.constData(), bytes.size());
+        dictionary->cdict = ZSTD_createCDict(bytes.constData(), bytes.size(), zstdCompressionLevel);
+        dictionary->ddict = ZSTD_createDDict(bytes.constData(), bytes.size());
+        if (dictionary->id == 0 || dictionary->cdict == nullptr || dictionary->ddict == nullptr) {
+            qWarning() << "Ignoring invalid tile cache dictionary.";
+            return nullptr;
+        }
+        return dictionary;
+#else
+        Q_UNUSED(bytes);
+        return nullptr;
+#endif
+    }
+
+#ifdef TILE_CACHE_ZSTD
+    unsigned id = 0;
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+
+    ~CompressionDictionary() {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+    }
+#endif
+};
+
+#ifdef TILE_CACHE_ZSTD
+// Returns std::nullopt if compressing didn't make the payload any smaller.
+static std::optional<QByteArray> compressPayload(
+    QByteArray const& bytes,
+    TileDiskCache::CompressionDictionary const* dictionary)
+{
+    // Contexts are expensive to set up, so every thread keeps its own.
+    thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context { ZSTD_createCCtx(), &ZSTD_freeCCtx };
+
+    QByteArray out { qsizetype(ZSTD_compressBound(bytes.size())), Qt::Uninitialized };
+    size_t size = dictionary != nullptr ?
+        ZSTD_compress_usingCDict(
+            context.get(),
+            out.data(), out.size(),
+            bytes.constData(), bytes.size(),
+            dictionary->cdict) :
+        ZSTD_compressCCtx(
+            context.get(),
+            out.data(), out.size(),
+            bytes.constData(), bytes.size(),
+            zstdCompressionLevel);
+    if (ZSTD_isError(size) || qsizetype(size) >= bytes.size()) {
+        return std::nullopt;
+    }
+    out.resize(qsizetype(size));
+    return out;
+}
+#endif
+
+// Returns std::nullopt if the payload is corrupt, was compressed with a dictionary
+// we don't have, or zstd support isn't built in.
+static std::optional<QByteArray> decompressPayload(
+    char const* data,
+    qsizetype length,
+    TileDiskCache::CompressionDictionary const* dictionary)
+{
+#ifdef TILE_CACHE_ZSTD
+    auto contentSize = ZSTD_getFrameContentSize(data, length);
+    if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN ||
+        contentSize == ZSTD_CONTENTSIZE_ERROR ||
+        contentSize > maxDecompressedSize)
+    {
+        return std::nullopt;
+    }
+    auto dictionaryId = ZSTD_getDictID_fromFrame(data, length);
+    if (dictionaryId != 0 && (dictionary == nullptr || dictionary->id != dictionaryId)) {
+        return std::nullopt;
+    }
+
+    thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context { ZSTD_createDCtx(), &ZSTD_freeDCtx };
+
+    QByteArray out { qsizetype(contentSize), Qt::Uninitialized };
+    size_t size = dictionaryId != 0 ?
+        ZSTD_decompress_usingDDict(context.get(), out.data(), out.size(), data, length, dictionary->ddict) :
+        ZSTD_decompressDCtx(context.get(), out.data(), out.size(), data, length);
+    if (ZSTD_isError(size) || size != contentSize) {
+        return std::nullopt;
+    }
+    return out;
+#else
+    Q_UNUSED(data);
+    Q_UNUSED(length);
+    Q_UNUSED(dictionary);
+    return std::nullopt;
+#endif
+}
+
+// Makes sure the records written to the segment have reached the disk.
+// QFile::flush only hands them over to the OS, which is not enough
+// to survive a power loss.
+static bool syncSegment(TileDiskCache::Segment& segment)
+{
+    if (!segment.needsSync) {
+        return true;
+    }
+    if (!segment.file.flush()) {
+        return false;
+    }
+#if defined(Q_OS_WINDOWS)
+    bool success = _commit(segment.file.handle()) == 0;
+#elif defined(Q_OS_LINUX)
+    bool success = fdatasync(segment.file.handle()) == 0;
+#else
+    bool success = fsync(segment.file.handle()) == 0;
+#endif
+    if (!success) {
+        qWarning() << "Unable to sync tile cache segment" << segment.path;
+        return false;
+    }
+    segment.needsSync = false;
+    return true;
+}
+
+// Maps the segment so it can be read without holding the shard lock.
+static void sealSegment(TileDiskCache::Segment& segment)
+{
+    syncSegment(segment);
+    if (segment.size > 0) {
+        segment.mapping = segment.file.map(0, segment.size);
+    }
+}
+
+// Updates the index to include a record that was just appended, or recovered
+// from a segment file. Anything it supersedes is counted as garbage.
+//
+// The shard lock must be held.
+static void applyRecordToIndex(
+    TileDiskCache::Shard& shard,
+    TileDiskCache::Segment& segment,
+    qint64 offset,
+    RecordHeader const& header)
+{
+    auto recordSize = recordHeaderSize + qint64(header.length);
+
+    TileDiskCache::Shard::IndexEntry entry;
+    entry.lastAccessSecs = header.writtenAtSecs;
+
+    auto it = shard.entries.find(header.packedKey);
+    if (it != shard.entries.end()) {
+        auto oldSegmentIt = shard.segments.find(it->second.segmentId);
+        if (oldSegmentIt != shard.segments.end()) {
+            oldSegmentIt->second->deadBytes += recordHeaderSize + qint64(it->second.length);
+        }
+        // How popular a tile is doesn't change just because it was rewritten.
+        entry.lastAccessSecs = std::max(entry.lastAccessSecs, it->second.lastAccessSecs);
+        entry.accessCount = it->second.accessCount;
+    }
+
+    if (header.kind == TileDiskCache::EntryKind::Removed) {
+        if (it != shard.entries.end()) {
+            shard.entries.erase(it);
+        }
+        // The tombstone itself is only needed until the index is saved.
+        segment.deadBytes += recordSize;
+        return;
+    }
+
+    entry.segmentId = segment.id;
+    entry.offset = offset;
+    entry.length = header.length;
+    entry.kind = header.kind;
+    entry.writtenAtSecs = header.writtenAtSecs;
+    shard.entries[header.packedKey] = entry;
+}
+
+// Reads records from the segment file starting at segment.size, adding them to
+// the index. Stops at the first record that is torn or corrupt, and cuts the
+// file off there.
+//
+// The shard lock must be held.
+static void recoverSegmentTail(TileDiskCache::Shard& shard, TileDiskCache::Segment& segment)
+{
+    auto fileSize = segment.file.size();
+    if (!segment.file.seek(segment.size)) {
+        return;
+    }
+
+    while (segment.size + recordHeaderSize <= fileSize) {
+        char headerBytes[recordHeaderSize];
+        if (segment.file.read(headerBytes, recordHeaderSize) != recordHeaderSize) {
+            break;
+        }
+        auto headerOpt = readRecordHeader(headerBytes);
+        if (!headerOpt.has_value()) {
+            break;
+        }
+        auto const& header = headerOpt.value();
+        if (segment.size + recordHeaderSize + qint64(header.length) > fileSize) {
+            break;
+        }
+        auto payload = segment.file.read(header.length);
+        if (payload.size() != qsizetype(header.length) ||
+            calcChecksum(payload.constData(), payload.size()) != header.checksum)
+        {
+            break;
+        }
+
+        applyRecordToIndex(shard, segment, segment.size, header);
+        segment.size += recordHeaderSize + qint64(header.length);
+    }
+
+    if (segment.size < fileSize) {
+        qWarning() << "Discarding torn records at the end of" << segment.path;
+        segment.file.resize(segment.size);
+    }
+}
+
+TileDiskCache::TileDiskCache(QString const& directory, Compression compression) :
+    m_directory{ directory },
+    m_shards{ std::make_unique<Shard[]>(shardCount) },
+    m_compression{ compression }
+{
+    for (int i = 0; i < shardCount; i++) {
+        m_shards[i].index = i;
+    }
+
+    // The dictionary is small, and has to be loaded before
+    // any record that was compressed with it is read.
+    QFile dictionaryFile { dictionaryFilePath(m_directory) };
+    if (dictionaryFile.open(QFile::ReadOnly)) {
+        m_dictionary = CompressionDictionary::create(dictionaryFile.readAll());
+    }
+}
+
+TileDiskCache::~TileDiskCache()
+{
+    saveIndex();
+}
+
+int TileDiskCache::calcShardIndex(TileCoord coord)
+{
+    // Spread neighboring tiles across shards.
+    static_assert(shardCount == 8, "The shift below assumes 8 shards.");
+    auto hash = coord.toPackedKey() * 0x9E3779B97F4A7C15ull;
+    return int(hash >> 61);
+}
+
+TileDiskCache::Shard& TileDiskCache::getShard(TileCoord coord)
+{
+    auto& shard = m_shards[calcShardIndex(coord)];
+    std::call_once(shard.openOnce, [&]() { openShard(shard); });
+    return shard;
+}
+
+void TileDiskCache::openShard(Shard& shard)
+{
+    QDir{}.mkpath(m_directory);
+
+    auto autoLock = std::lock_guard{ shard.lock };
+
+    // Load the index from the last time it was saved.
+    QFile indexFile { indexFilePath(m_directory, shard.index) };
+    if (indexFile.open(QFile::ReadOnly)) {
+        QDataStream stream { &indexFile };
+        quint32 magic = 0;
+        quint32 version = 0;
+        stream >> magic >> version;
+        if (magic == indexMagic && (version == 1 || version == indexVersion)) {
+            quint32 segmentCount = 0;
+            stream >> shard.nextSegmentId >> segmentCount;
+            for (quint32 i = 0; i < segmentCount && stream.status() == QDataStream::Ok; i++) {
+                auto segment = std::make_shared<Segment>();
+                stream >> segment->id >> segment->size >> segment->deadBytes;
+                segment->path = segmentFilePath(m_directory, shard.index, segment->id);
+                shard.segments.insert({ segment->id, segment });
+            }
+            quint64 entryCount = 0;
+            stream >> entryCount;
+            for (quint64 i = 0; i < entryCount && stream.status() == QDataStream::Ok; i++) {
+                quint64 packedKey = 0;
+                Shard::IndexEntry entry;
+                quint8 kind = 0;
+                stream >> packedKey >> entry.segmentId >> entry.offset >> entry.length >> kind >> entry.writtenAtSecs;
+                entry.kind = EntryKind(kind);
+                if (version >= 2) {
+                    stream >> entry.lastAccessSecs >> entry.accessCount;
+                } else {
+                    entry.lastAccessSecs = entry.writtenAtSecs;
+                }
+                shard.entries.insert({ packedKey, entry });
+            }
+            if (stream.status() != QDataStream::Ok) {
+                qWarning() << "Corrupt tile cache index, starting over:" << indexFile.fileName();
+                shard.segments.clear();
+                shard.entries.clear();
+                shard.nextSegmentId = 0;
+            }
+        }
+    }
+
+    // Pick up segments that were created after the index was saved.
+    while (QFile::exists(segmentFilePath(m_directory, shard.index, shard.nextSegmentId))) {
+        auto segment = std::make_shared<Segment>();
+        segment->id = shard.nextSegmentId;
+        segment->path = segmentFilePath(m_directory, shard.index, segment->id);
+        shard.segments.insert({ segment->id, segment });
+        shard.nextSegmentId++;
+    }
+
+    // Open every segment. Segments that have gone missing take their entries with them.
+    for (auto it = shard.segments.begin(); it != shard.segments.end();) {
+        auto& segment = *it->second;
+        segment.file.setFileName(segment.path);
+        if (!segment.file.open(QFile::ReadWrite) || segment.file.size() < segment.size) {
+            qWarning() << "Tile cache segment is missing or truncated:" << segment.path;
+            auto segmentId = segment.id;
+            for (auto entryIt = shard.entries.begin(); entryIt != shard.entries.end();) {
+                if (entryIt->second.segmentId == segmentId) {
+                    entryIt = shard.entries.erase(entryIt);
+                } else {
+                    entryIt++;
+                }
+            }
+            it = shard.segments.erase(it);
+            continue;
+        }
+        it++;
+    }
+
+    // Recover anything written after the index was saved, oldest segment first
+    // so that newer records win.
+    for (auto& [segmentId, segment] : shard.segments) {
+        recoverSegmentTail(shard, *segment);
+    }
+
+    // Only the newest segment is written to.
+    for (auto& [segmentId, segment] : shard.segments) {
+        bool isNewest = segmentId == shard.segments.rbegin()->first;
+        if (isNewest && segment->size < maxSegmentSize) {
+            shard.activeSegment = segment;
+        } else {
+            sealSegment(*segment);
+        }
+    }
+
+    shard.isOpen = true;
+}
+
+std::optional<TileDiskCache::ReadResult> TileDiskCache::read(TileCoord coord)
+{
+    return readEntry(coord, true);
+}
+
+std::optional<TileDiskCache::Record> TileDiskCache::readRecord(TileCoord coord, bool countAccess)
+{
+    auto& shard = getShard(coord);
+    auto packedKey = coord.toPackedKey();
+
+    Shard::IndexEntry entry;
+    std::shared_ptr<Segment> segment;
+    QByteArray recordBytes;
+    {
+        auto autoLock = std::lock_guard{ shard.lock };
+        auto it = shard.entries.find(packedKey);
+        if (it == shard.entries.end()) {
+            return std::nullopt;
+        }
+        if (countAccess) {
+            it->second.lastAccessSecs = QDateTime::currentSecsSinceEpoch();
+            it->second.accessCount++;
+            shard.accessStatsChanged = true;
+        }
+
+        entry = it->second;
+        segment = shard.segments.at(entry.segmentId);
+
+        // The active segment is still being appended to, so it's not mapped.
+        // Read it while we hold the lock that guards the file position.
+        if (segment->mapping == nullptr) {
+            auto recordSize = recordHeaderSize + qint64(entry.length);
+            if (segment->file.seek(entry.offset)) {
+                recordBytes = segment->file.read(recordSize);
+            }
+            segment = nullptr;
+        }
+    }
+
+    char const* record = nullptr;
+    if (segment != nullptr) {
+        record = reinterpret_cast<char const*>(segment->mapping + entry.offset);
+    } else if (recordBytes.size() == recordHeaderSize + qsizetype(entry.length)) {
+        record = recordBytes.constData();
+    }
+
+    auto headerOpt = record != nullptr ? readRecordHeader(record) : std::nullopt;
+    bool valid =
+        headerOpt.has_value() &&
+        headerOpt->packedKey == packedKey &&
+        headerOpt->length == entry.length &&
+        calcChecksum(record + recordHeaderSize, entry.length) == headerOpt->checksum;
+    if (valid && (headerOpt->flags & recordFlagMetadata)) {
+        valid =
+            entry.length >= 4 &&
+            qFromLittleEndian<quint32>(record + recordHeaderSize) <= entry.length - 4;
+    }
+    if (!valid) {
+        qWarning() << "Corrupt tile cache record for" << coord.level << coord.x << coord.y;
+        remove(coord);
+        return std::nullopt;
+    }
+
+    Record result;
+    result.kind = entry.kind;
+    result.flags = headerOpt->flags;
+    result.writtenAtSecs = entry.writtenAtSecs;
+    result.segmentId = entry.segmentId;
+    result.offset = entry.offset;
+    if (segment != nullptr) {
+        result.payload = QByteArray::fromRawData(record + recordHeaderSize, entry.length);
+        result.keepAlive = std::move(segment);
+    } else {
+        result.payload = recordBytes.mid(recordHeaderSize);
+    }
+    return result;
+}
+
+// Splits the payload of a record into its metadata and its bytes,
+// neither of which are copied. The record has already been validated.
+static std::pair<QByteArray, QByteArray> splitPayload(QByteArray const& payload, quint8 flags)
+{
+    if ((flags & recordFlagMetadata) == 0) {
+        return { {}, payload };
+    }
+    auto metadataLength = qsizetype(qFromLittleEndian<quint32>(payload.constData()));
+    auto bytesOffset = 4 + metadataLength;
+    return {
+        QByteArray::fromRawData(payload.constData() + 4, metadataLength),
+        QByteArray::fromRawData(payload.constData() + bytesOffset, payload.size() - bytesOffset),
+    };
+}
+
+// The inverse of splitPayload. Adds the metadata flag if there is metadata.
+static QByteArray joinPayload(QByteArray const& metadata, QByteArray const& bytes, quint8& inOutFlags)
+{
+    if (metadata.isEmpty()) {
+        inOutFlags &= ~recordFlagMetadata;
+        return bytes;
+    }
+    inOutFlags |= recordFlagMetadata;
+    QByteArray payload;
+    payload.reserve(4 + metadata.size() + bytes.size());
+    char lengthBytes[4];
+    qToLittleEndian<quint32>(quint32(metadata.size()), lengthBytes);
+    payload.append(lengthBytes, 4);
+    payload.append(metadata);
+    payload.append(bytes);
+    return payload;
+}
+
+std::optional<TileDiskCache::ReadResult> TileDiskCache::readEntry(TileCoord coord, bool countAccess)
+{
+    auto recordOpt = readRecord(coord, countAccess);
+    if (!recordOpt.has_value()) {
+        return std::nullopt;
+    }
+    auto& record = recordOpt.value();
+    auto [metadata, bytes] = splitPayload(record.payload, record.flags);
+
+    ReadResult result;
+    result.kind = record.kind;
+    result.writtenAtSecs = record.writtenAtSecs;
+    // Metadata is tiny, so it gets a copy of its own.
+    result.metadata = QByteArray{ metadata.constData(), metadata.size() };
+    if (record.flags & recordFlagZstd) {
+        auto bytesOpt = decompressPayload(
+            bytes.constData(),
+            quint32(bytes.size()),
+            std::atomic_load(&m_dictionary).get());
+        if (!bytesOpt.has_value()) {
+            qWarning() << "Unable to decompress tile cache record for" << coord.level << coord.x << coord.y;
+            remove(coord);
+            return std::nullopt;
+        }
+        result.bytes = std::move(bytesOpt.value());
+    } else if (record.keepAlive != nullptr) {
+        result.bytes = bytes;
+        result.keepAlive = std::move(record.keepAlive);
+    } else {
+        result.bytes = QByteArray{ bytes.constData(), bytes.size() };
+    }
+    return result;
+}
+
+std::optional<QByteArray> TileDiskCache::readMetadata(TileCoord coord)
+{
+    auto recordOpt = readRecord(coord, true);
+    if (!recordOpt.has_value()) {
+        return std::nullopt;
+    }
+    auto metadata = splitPayload(recordOpt->payload, recordOpt->flags).first;
+    return QByteArray{ metadata.constData(), metadata.size() };
+}
+
+bool TileDiskCache::contains(TileCoord coord)
+{
+    auto& shard = getShard(coord);
+    auto autoLock = std::lock_guard{ shard.lock };
+    return shard.entries.find(coord.toPackedKey()) != shard.entries.end();
+}
+
+std::optional<bool> TileDiskCache::tryContains(TileCoord coord)
+{
+    auto& shard = m_shards[calcShardIndex(coord)];
+    if (!shard.isOpen) {
+        return std::nullopt;
+    }
+    auto autoLock = std::lock_guard{ shard.lock };
+    return shard.entries.find(coord.toPackedKey()) != shard.entries.end();
+}
+
+void TileDiskCache::openAll()
+{
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& shard = m_shards[shardIndex];
+        std::call_once(shard.openOnce, [&]() { openShard(shard); });
+    }
+}
+
+namespace {
+    // A record waiting to be appended. The length and checksum
+    // in the header are filled in from the payload.
+    struct PendingRecord {
+        RecordHeader header;
+        QByteArray payload;
+    };
+}
+
+// Appends the records to the active segment of the shard with a single write,
+// starting a new segment first if needed.
+//
+// The shard lock must be held.
+static bool appendRecords(
+    QString const& directory,
+    qint64 maxSegmentSize,
+    TileDiskCache::Shard& shard,
+    std::vector<PendingRecord>& records)
+{
+    if (shard.activeSegment != nullptr && shard.activeSegment->size >= maxSegmentSize) {
+        sealSegment(*shard.activeSegment);
+        shard.activeSegment = nullptr;
+    }
+    if (shard.activeSegment == nullptr) {
+        auto segment = std::make_shared<TileDiskCache::Segment>();
+        segment->id = shard.nextSegmentId++;
+        segment->path = segmentFilePath(directory, shard.index, segment->id);
+        segment->file.setFileName(segment->path);
+        if (!segment->file.open(QFile::ReadWrite | QFile::Truncate)) {
+            qWarning() << "Unable to create tile cache segment:" << segment->file.errorString();
+            return false;
+        }
+        shard.segments.insert({ segment->id, segment });
+        shard.activeSegment = segment;
+    }
+    auto& segment = *shard.activeSegment;
+
+    qsizetype totalSize = 0;
+    for (auto const& record : records) {
+        totalSize += recordHeaderSize + record.payload.size();
+    }
+    QByteArray bytes;
+    bytes.reserve(totalSize);
+    for (auto& record : records) {
+        record.header.length = quint32(record.payload.size());
+        record.header.checksum = calcChecksum(record.payload.constData(), record.payload.size());
+        char headerBytes[recordHeaderSize];
+        writeRecordHeader(headerBytes, record.header);
+        bytes.append(headerBytes, recordHeaderSize);
+        bytes.append(record.payload);
+    }
+
+    // If anything goes wrong, the partial records are cut off so the
+    // next record starts in the right place.
+    bool success =
+        segment.file.seek(segment.size) &&
+        segment.file.write(bytes) == bytes.size() &&
+        segment.file.flush();
+    if (!success) {
+        qWarning() << "Unable to write to tile cache segment:" << segment.file.errorString();
+        segment.file.resize(segment.size);
+        return false;
+    }
+
+    segment.needsSync = true;
+    for (auto const& record : records) {
+        applyRecordToIndex(shard, segment, segment.size, record.header);
+        segment.size += recordHeaderSize + qint64(record.payload.size());
+        shard.changesSinceSave++;
+    }
+    return true;
+}
+
+// The shard lock must be held.
+static bool appendRecord(
+    QString const& directory,
+    qint64 maxSegmentSize,
+    TileDiskCache::Shard& shard,
+    RecordHeader header,
+    QByteArray const& payload)
+{
+    std::vector<PendingRecord> records { { header, payload } };
+    return appendRecords(directory, maxSegmentSize, shard, records);
+}
+
+bool TileDiskCache::write(TileCoord coord, EntryKind kind, QByteArray const& bytes, QByteArray const& metadata)
+{
+    return writeBatch({ { coord, kind, bytes, metadata } });
+}
+
+bool TileDiskCache::writeBatch(std::vector<WriteItem> const& items)
+{
+    auto writtenAtSecs = QDateTime::currentSecsSinceEpoch();
+#ifdef TILE_CACHE_ZSTD
+    auto dictionary = std::atomic_load(&m_dictionary);
+#endif
+    std::array<std::vector<PendingRecord>, shardCount> recordsPerShard;
+    for (auto const& item : items) {
+        PendingRecord record;
+        record.header.kind = item.kind;
+        record.header.packedKey = item.coord.toPackedKey();
+        record.header.writtenAtSecs = writtenAtSecs;
+        record.payload = item.bytes;
+#ifdef TILE_CACHE_ZSTD
+        // Compress before taking the lock.
+        if (m_compression == Compression::Zstd && item.kind == EntryKind::Tile && !item.bytes.isEmpty()) {
+            auto compressedOpt = compressPayload(item.bytes, dictionary.get());
+            if (compressedOpt.has_value()) {
+                record.header.flags |= recordFlagZstd;
+                record.payload = std::move(compressedOpt.value());
+            }
+        }
+#endif
+        if (!item.metadata.isEmpty()) {
+            record.payload = joinPayload(item.metadata, record.payload, record.header.flags);
+        }
+        recordsPerShard[calcShardIndex(item.coord)].push_back(std::move(record));
+    }
+
+    bool success = true;
+    bool needsSave = false;
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& records = recordsPerShard[shardIndex];
+        if (records.empty()) {
+            continue;
+        }
+        auto& shard = m_shards[shardIndex];
+        std::call_once(shard.openOnce, [&]() { openShard(shard); });
+
+        auto autoLock = std::lock_guard{ shard.lock };
+        success &= appendRecords(m_directory, maxSegmentSize, shard, records);
+        // One sync for the whole batch, rather than one for each record.
+        if (shard.activeSegment != nullptr) {
+            success &= syncSegment(*shard.activeSegment);
+        }
+        needsSave |= shard.changesSinceSave >= changesBetweenIndexSaves;
+    }
+
+    if (needsSave) {
+        saveIndex();
+    }
+    return success;
+}
+
+bool TileDiskCache::updateMetadata(TileCoord coord, QByteArray const& metadata)
+{
+    // Carries over the bytes as they are stored, so compressed tiles
+    // don't need to be decompressed and compressed again.
+    auto recordOpt = readRecord(coord, false);
+    if (!recordOpt.has_value()) {
+        return false;
+    }
+    auto& record = recordOpt.value();
+
+    RecordHeader header;
+    header.kind = record.kind;
+    header.flags = record.flags;
+    header.packedKey = coord.toPackedKey();
+    header.writtenAtSecs = record.writtenAtSecs;
+    auto payload = joinPayload(metadata, splitPayload(record.payload, record.flags).second, header.flags);
+
+    auto& shard = getShard(coord);
+    auto autoLock = std::lock_guard{ shard.lock };
+    auto it = shard.entries.find(header.packedKey);
+    if (it == shard.entries.end() ||
+        it->second.segmentId != record.segmentId ||
+        it->second.offset != record.offset)
+    {
+        // Overwritten or removed in the meantime, whatever happened is newer than this.
+        return false;
+    }
+    return appendRecord(m_directory, maxSegmentSize, shard, header, payload);
+}
+
+void TileDiskCache::remove(TileCoord coord)
+{
+    auto& shard = getShard(coord);
+    auto autoLock = std::lock_guard{ shard.lock };
+    if (shard.entries.find(coord.toPackedKey()) == shard.entries.end()) {
+        return;
+    }
+
+    RecordHeader header;
+    header.kind = EntryKind::Removed;
+    header.packedKey = coord.toPackedKey();
+    header.writtenAtSecs = QDateTime::currentSecsSinceEpoch();
+    if (!appendRecord(m_directory, maxSegmentSize, shard, header, {})) {
+        // We couldn't write the tombstone, but we can at least forget about
+        // the tile until the next restart.
+        shard.entries.erase(coord.toPackedKey());
+    }
+}
+
+void TileDiskCache::compact()
+{
+    auto maintenanceLock = std::unique_lock{ m_maintenanceLock, std::try_to_lock };
+    if (!maintenanceLock.owns_lock()) {
+        return;
+    }
+    compactLocked();
+}
+
+void TileDiskCache::compactLocked()
+{
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& shard = m_shards[shardIndex];
+        std::call_once(shard.openOnce, [&]() { openShard(shard); });
+
+        // Find the sealed segments that are mostly garbage.
+        std::vector<std::shared_ptr<Segment>> candidates;
+        {
+            auto autoLock = std::lock_guard{ shard.lock };
+            for (auto const& [segmentId, segment] : shard.segments) {
+                if (segment != shard.activeSegment && segment->deadBytes * 2 >= segment->size) {
+                    candidates.push_back(segment);
+                }
+            }
+        }
+
+        for (auto const& segment : candidates) {
+            std::vector<quint64> liveKeys;
+            {
+                auto autoLock = std::lock_guard{ shard.lock };
+                for (auto const& [packedKey, entry] : shard.entries) {
+                    if (entry.segmentId == segment->id) {
+                        liveKeys.push_back(packedKey);
+                    }
+                }
+            }
+
+            // Copy the live records one at a time, so that
+            // reads and writes can get in between.
+            for (auto packedKey : liveKeys) {
+                auto autoLock = std::lock_guard{ shard.lock };
+                auto it = shard.entries.find(packedKey);
+                if (it == shard.entries.end() || it->second.segmentId != segment->id) {
+                    // Overwritten or removed in the meantime.
+                    continue;
+                }
+                auto const& entry = it->second;
+                if (segment->mapping == nullptr) {
+                    continue;
+                }
+                auto record = reinterpret_cast<char const*>(segment->mapping + entry.offset);
+                RecordHeader header;
+                header.kind = entry.kind;
+                // The flags aren't kept in the index, they say how the payload is encoded.
+                auto originalHeaderOpt = readRecordHeader(record);
+                header.flags = originalHeaderOpt.has_value() ? originalHeaderOpt->flags : 0;
+                header.packedKey = packedKey;
+                header.writtenAtSecs = entry.writtenAtSecs;
+                auto payload = QByteArray::fromRawData(record + recordHeaderSize, entry.length);
+                appendRecord(m_directory, maxSegmentSize, shard, header, payload);
+            }
+
+            bool canDelete = false;
+            {
+                auto autoLock = std::lock_guard{ shard.lock };
+                canDelete = std::none_of(
+                    shard.entries.begin(),
+                    shard.entries.end(),
+                    [&](auto const& item) { return item.second.segmentId == segment->id; });
+                if (canDelete) {
+                    shard.segments.erase(segment->id);
+                    shard.changesSinceSave++;
+                }
+            }
+
+            if (canDelete) {
+                // The index has to stop referring to the segment
+                // before the file can go away.
+                saveIndex();
+                segment->deleteWhenReleased = true;
+            }
+        }
+    }
+}
+
+void TileDiskCache::saveIndex()
+{
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& shard = m_shards[shardIndex];
+        auto saveLock = std::lock_guard{ shard.saveLock };
+
+        QByteArray indexBytes;
+        {
+            auto autoLock = std::lock_guard{ shard.lock };
+            if (!shard.isOpen || (shard.changesSinceSave == 0 && !shard.accessStatsChanged)) {
+                continue;
+            }
+
+            // The index must never point to records that haven't reached the disk.
+            // Sealed segments were synced when they were sealed.
+            if (shard.activeSegment != nullptr && !syncSegment(*shard.activeSegment)) {
+                continue;
+            }
+
+            QDataStream stream { &indexBytes, QIODevice::WriteOnly };
+            stream << indexMagic << indexVersion;
+            stream << shard.nextSegmentId << quint32(shard.segments.size());
+            for (auto const& [segmentId, segment] : shard.segments) {
+                stream << segment->id << segment->size << segment->deadBytes;
+            }
+            stream << quint64(shard.entries.size());
+            for (auto const& [packedKey, entry] : shard.entries) {
+                stream << packedKey << entry.segmentId << entry.offset << entry.length;
+                stream << quint8(entry.kind) << entry.writtenAtSecs;
+                stream << entry.lastAccessSecs << entry.accessCount;
+            }
+            shard.changesSinceSave = 0;
+            shard.accessStatsChanged = false;
+        }
+
+        // Written to a temporary file first and then renamed,
+        // so a crash leaves either the old or the new index.
+        QSaveFile file { indexFilePath(m_directory, shard.index) };
+        if (!file.open(QIODevice::WriteOnly) ||
+            file.write(indexBytes) != indexBytes.size() ||
+            !file.commit())
+        {
+            qWarning() << "Unable to save tile cache index:" << file.errorString();
+        }
+    }
+}
+
+qint64 TileDiskCache::calcLiveBytes()
+{
+    qint64 liveBytes = 0;
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& shard = m_shards[shardIndex];
+        std::call_once(shard.openOnce, [&]() { openShard(shard); });
+        auto autoLock = std::lock_guard{ shard.lock };
+        for (auto const& [segmentId, segment] : shard.segments) {
+            liveBytes += segment->size - segment->deadBytes;
+        }
+    }
+    return liveBytes;
+}
+
+void TileDiskCache::trainCompressionDictionary()
+{
+#ifdef TILE_CACHE_ZSTD
+    if (m_compression != Compression::Zstd || std::atomic_load(&m_dictionary) != nullptr) {
+        return;
+    }
+    auto maintenanceLock = std::unique_lock{ m_maintenanceLock, std::try_to_lock };
+    if (!maintenanceLock.owns_lock()) {
+        return;
+    }
+
+    std::vector<TileCoord> sampleCoords;
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& shard = m_shards[shardIndex];
+        std::call_once(shard.openOnce, [&]() { openShard(shard); });
+        auto autoLock = std::lock_guard{ shard.lock };
+        for (auto const& [packedKey, entry] : shard.entries) {
+            if (sampleCoords.size() >= size_t(maxDictionarySamples)) {
+                break;
+            }
+            if (entry.kind == EntryKind::Tile) {
+                sampleCoords.push_back(TileCoord::fromPackedKey(packedKey));
+            }
+        }
+    }
+    if (sampleCoords.size() < size_t(minDictionarySamples)) {
+        return;
+    }
+
+    // zstd wants all the samples back to back.
+    QByteArray samples;
+    std::vector<size_t> sampleSizes;
+    for (auto const& coord : sampleCoords) {
+        if (samples.size() >= maxDictionarySampleBytes) {
+            break;
+        }
+        auto sampleOpt = readEntry(coord, false);
+        if (sampleOpt.has_value() && sampleOpt->kind == EntryKind::Tile) {
+            samples.append(sampleOpt->bytes);
+            sampleSizes.push_back(size_t(sampleOpt->bytes.size()));
+        }
+    }
+
+    QByteArray dictionaryBytes { maxDictionarySize, Qt::Uninitialized };
+    auto dictionarySize = ZDICT_trainFromBuffer(
+        dictionaryBytes.data(),
+        size_t(dictionaryBytes.size()),
+        samples.constData(),
+        sampleSizes.data(),
+        unsigned(sampleSizes.size()));
+    if (ZDICT_isError(dictionarySize)) {
+        qWarning() << "Unable to train tile cache dictionary:" << ZDICT_getErrorName(dictionarySize);
+        return;
+    }
+    dictionaryBytes.resize(qsizetype(dictionarySize));
+
+    auto dictionary = CompressionDictionary::create(dictionaryBytes);
+    if (dictionary == nullptr) {
+        return;
+    }
+
+    // Records will start depending on the dictionary as soon as it's in use,
+    // so it has to be safely on disk first.
+    QSaveFile file { dictionaryFilePath(m_directory) };
+    bool saved =
+        file.open(QFile::WriteOnly) &&
+        file.write(dictionaryBytes) == dictionaryBytes.size() &&
+        file.commit();
+    if (!saved) {
+        qWarning() << "Unable to save tile cache dictionary:" << file.errorString();
+        return;
+    }
+    std::atomic_store(&m_dictionary, dictionary);
+#endif
+}
+
+void TileDiskCache::evictOverBudget()
+{
+    auto maintenanceLock = std::unique_lock{ m_maintenanceLock, std::try_to_lock };
+    if (!maintenanceLock.owns_lock()) {
+        return;
+    }
+
+    auto liveBytes = calcLiveBytes();
+    auto budgetBytes = getBudgetBytes();
+    if (liveBytes <= budgetBytes) {
+        return;
+    }
+    auto bytesToFree = liveBytes - qint64(budgetBytes * evictionTargetFraction);
+
+    // Rank every entry that can be evicted. Recently read tiles are worth more,
+    // and tiles that are read a lot are worth even more.
+    struct Candidate {
+        int shardIndex = 0;
+        quint64 packedKey = 0;
+        Shard::IndexEntry entry;
+        double score = 0;
+    };
+    std::vector<Candidate> candidates;
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& shard = m_shards[shardIndex];
+        auto autoLock = std::lock_guard{ shard.lock };
+        for (auto const& [packedKey, entry] : shard.entries) {
+            if (TileCoord::fromPackedKey(packedKey).level <= protectedMaxZoom) {
+                continue;
+            }
+            Candidate candidate;
+            candidate.shardIndex = shardIndex;
+            candidate.packedKey = packedKey;
+            candidate.entry = entry;
+            candidate.score =
+                double(entry.lastAccessSecs) +
+                std::log2(1.0 + entry.accessCount) * evictionSecsPerAccessDoubling;
+            candidates.push_back(candidate);
+        }
+    }
+
+    std::sort(
+        candidates.begin(),
+        candidates.end(),
+        [](Candidate const& a, Candidate const& b) { return a.score < b.score; });
+
+    // Pick the victims, then group them by shard so
+    // that we take each shard lock once.
+    std::vector<std::vector<Candidate const*>> victimsPerShard(shardCount);
+    qint64 bytesFreed = 0;
+    for (auto const& candidate : candidates) {
+        if (bytesFreed >= bytesToFree) {
+            break;
+        }
+        victimsPerShard[candidate.shardIndex].push_back(&candidate);
+        bytesFreed += recordHeaderSize + qint64(candidate.entry.length);
+    }
+
+    for (int shardIndex = 0; shardIndex < shardCount; shardIndex++) {
+        auto& shard = m_shards[shardIndex];
+        auto autoLock = std::lock_guard{ shard.lock };
+        for (auto const* victim : victimsPerShard[shardIndex]) {
+            auto it = shard.entries.find(victim->packedKey);
+            if (it == shard.entries.end() ||
+                it->second.segmentId != victim->entry.segmentId ||
+                it->second.offset != victim->entry.offset)
+            {
+                // Rewritten in the meantime.
+                continue;
+            }
+            auto segmentIt = shard.segments.find(it->second.segmentId);
+            if (segmentIt != shard.segments.end()) {
+                segmentIt->second->deadBytes += recordHeaderSize + qint64(it->second.length);
+            }
+            // No tombstone is written. If we crash before the index is saved,
+            // the entry comes back, which is harmless.
+            shard.entries.erase(it);
+            shard.changesSinceSave++;
+        }
+    }
+
+    saveIndex();
+    compactLocked();
+}
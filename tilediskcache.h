@@ -0,0 +1,245 @@
+#ifndef TILEDISKCACHE_H
+#define TILEDISKCACHE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "tileloader.h"
+
+// Stores tiles on disk packed into a handful of large segment files,
+// instead of one file per tile.
+//
+// The cache is split into shards by tile, each with its own lock, its own
+// segment files and its own index. Every record in a segment file is
+// self-describing and checksummed, and segments are only ever appended to.
+// The index maps every tile to the location of its latest record, so
+// looking up and reading a tile never touches the directory.
+//
+// The index is periodically saved to disk. When opening the cache, any records
+// written after the last save are recovered by scanning the end of the
+// segment files, and a torn record at the very end is cut off.
+//
+// Overwriting or removing a tile leaves the old record behind as garbage.
+// compact() copies the live records out of segments that are mostly garbage,
+// then deletes them.
+//
+// Opening a shard loads its whole index into memory. openAll() does this up
+// front, after which tryContains() answers whether a tile is cached without
+// touching the disk.
+//
+// When built with TILE_CACHE_ZSTD, tiles can be compressed with zstd. Once
+// enough tiles are cached, a dictionary is trained from them and saved next to
+// the segments. Tiles share most of their layer names, keys and values, so
+// compressing with the dictionary works far better than compressing each tile
+// on its own. Tiles written before the dictionary existed stay readable.
+//
+// Entries can carry a small blob of metadata next to their bytes. The cache
+// doesn't look inside it. It can be read and replaced without touching the
+// bytes, which is cheaper when only the metadata changes.
+//
+// Every entry tracks when it was last read and how often, and this is saved
+// along with the index. evictOverBudget() uses it to throw out the least
+// valuable tiles once the cache grows beyond its budget.
+class TileDiskCache
+{
+public:
+    enum class Compression {
+        None,
+        // Only has an effect when built with TILE_CACHE_ZSTD.
+        Zstd,
+    };
+
+    explicit TileDiskCache(QString const& directory, Compression compression = Compression::None);
+    ~TileDiskCache();
+
+    TileDiskCache(TileDiskCache const&) = delete;
+    TileDiskCache& operator=(TileDiskCache const&) = delete;
+
+    enum class EntryKind : quint8 {
+        Tile = 1,
+        // The tile source told us this tile doesn't exist.
+        Missing = 2,
+        // Only used on disk, marks that a tile was removed.
+        Removed = 3,
+    };
+
+    class ReadResult {
+    public:
+        EntryKind kind = EntryKind::Tile;
+        // When the entry was written, in seconds since epoch.
+        qint64 writtenAtSecs = 0;
+        // Might point directly into a mapping of the segment file.
+        // Don't use the bytes after releasing keepAlive.
+        QByteArray bytes;
+        std::shared_ptr<void const> keepAlive;
+        // Whatever was written along with the entry, empty if nothing was.
+        QByteArray metadata;
+    };
+
+    // Thread-safe
+    //
+    // Returns std::nullopt if the tile is not in the cache,
+    // or if its record turned out to be corrupt.
+    //
+    // Compressed tiles are decompressed on the calling thread.
+    std::optional<ReadResult> read(TileCoord coord);
+
+    // Thread-safe
+    //
+    // Opens the shard of this tile if needed, which might block for a while.
+    bool contains(TileCoord coord);
+
+    // Thread-safe
+    //
+    // Like contains(), but never blocks on disk access. Returns std::nullopt
+    // if the shard of this tile hasn't been opened yet.
+    std::optional<bool> tryContains(TileCoord coord);
+
+    // Thread-safe
+    //
+    // Opens every shard, loading their indexes into memory. This can take a while,
+    // so it should be called from a background thread right after construction.
+    void openAll();
+
+    // Thread-safe
+    //
+    // Replaces any existing entry for this tile.
+    bool write(TileCoord coord, EntryKind kind, QByteArray const& bytes, QByteArray const& metadata = {});
+
+    class WriteItem {
+    public:
+        TileCoord coord;
+        EntryKind kind = EntryKind::Tile;
+        QByteArray bytes;
+        QByteArray metadata;
+    };
+
+    // Thread-safe
+    //
+    // Like write(), but for many tiles at once. The entries that belong to the
+    // same shard are appended with a single write while holding the lock once.
+    // Returns false if any of the entries couldn't be written.
+    bool writeBatch(std::vector<WriteItem> const& items);
+
+    // Thread-safe
+    //
+    // Returns only the metadata of the entry, without decompressing its bytes.
+    // Returns std::nullopt if the tile is not in the cache.
+    std::optional<QByteArray> readMetadata(TileCoord coord);
+
+    // Thread-safe
+    //
+    // Replaces the metadata of an existing entry and keeps its bytes.
+    // Returns false if the tile is not in the cache.
+    bool updateMetadata(TileCoord coord, QByteArray const& metadata);
+
+    // Thread-safe
+    void remove(TileCoord coord);
+
+    // Thread-safe
+    //
+    // Rewrites segments that are mostly garbage. This can take a while,
+    // so it should be called from a background thread. Reads and writes
+    // can run concurrently.
+    void compact();
+
+    // Thread-safe
+    //
+    // Saves the index of every shard that has changed since last save.
+    void saveIndex();
+
+    // Thread-safe
+    //
+    // The amount of bytes the live entries are allowed to take up on disk.
+    // Garbage is not counted, since compaction takes care of that.
+    qint64 getBudgetBytes() const { return m_budgetBytes; }
+    void setBudgetBytes(qint64 newValue) { m_budgetBytes = newValue; }
+
+    // Thread-safe
+    //
+    // Returns the amount of bytes the live entries take up on disk.
+    qint64 calcLiveBytes();
+
+    // Thread-safe
+    //
+    // If the cache is over budget, evicts the least valuable entries until it's
+    // comfortably below, then compacts. Tiles at or below protectedMaxZoom are
+    // never evicted, they're few and they're needed all the time.
+    //
+    // Like compact(), this should be called from a background thread. Shard locks
+    // are only held for short bursts, so reads and writes can run concurrently.
+    void evictOverBudget();
+    static constexpr int protectedMaxZoom = 6;
+
+    // Thread-safe
+    //
+    // Trains and saves the compression dictionary, if compression is enabled,
+    // there is no dictionary yet and enough tiles are cached to train one.
+    // Like compact(), this should be called from a background thread.
+    void trainCompressionDictionary();
+
+    // Defined in the .cpp file.
+    class Segment;
+    class Shard;
+    class CompressionDictionary;
+
+private:
+    static constexpr int shardCount = 8;
+    // Once the active segment grows beyond this,
+    // the next write starts a new one.
+    static constexpr qint64 maxSegmentSize = qint64(64) * 1024 * 1024;
+    // Saving the index after this many changes bounds how much
+    // of the segments needs to be scanned after a crash.
+    static constexpr int changesBetweenIndexSaves = 256;
+
+    static int calcShardIndex(TileCoord coord);
+    // Opens the shard if needed.
+    Shard& getShard(TileCoord coord);
+
+    // A validated record, with the payload exactly as it is stored.
+    class Record {
+    public:
+        EntryKind kind = EntryKind::Tile;
+        quint8 flags = 0;
+        qint64 writtenAtSecs = 0;
+        // Where the record is, to tell if the entry has been replaced since.
+        quint32 segmentId = 0;
+        qint64 offset = 0;
+        QByteArray payload;
+        std::shared_ptr<void const> keepAlive;
+    };
+
+    // countAccess is false for reads that shouldn't affect eviction.
+    std::optional<Record> readRecord(TileCoord coord, bool countAccess);
+    std::optional<ReadResult> readEntry(TileCoord coord, bool countAccess);
+
+    // m_maintenanceLock must be held.
+    void compactLocked();
+
+    // Loads the index and recovers whatever was written after it was saved.
+    // Called once per shard on first use.
+    void openShard(Shard& shard);
+
+    QString m_directory;
+    std::unique_ptr<Shard[]> m_shards;
+    std::atomic<qint64> m_budgetBytes = qint64(1024) * 1024 * 1024;
+
+    Compression m_compression = Compression::None;
+    // Null until one has been trained. Only ever set once,
+    // accessed through std::atomic_load and std::atomic_store.
+    std::shared_ptr<CompressionDictionary const> m_dictionary;
+
+    // Only one compaction or eviction runs at a time.
+    std::mutex m_maintenanceLock;
+};
+
+#endif // TILEDISKCACHE_H
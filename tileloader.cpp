@@ -1,31 +1,167 @@
 #include "tileloader.h"
 
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
 #include <QFile>
 #include <QDir>
-#include <QNetworkReply>
 #include <QStandardPaths>
+#include <QThread>
+#include <QTimer>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <optional>
 
 #include <vector_tile.pb.h>
 
 #include "MapboxGeometryDecoding.h"
+#include "tilesource.h"
+#include "mbtilestilesource.h"
+#include "pmtilestilesource.h"
+#include "tilediskcache.h"
 
 class TileLoader::TileLoaderImpl {
 public:
-    static void handleNetworkReply(
+    // Takes the result of a TileSource fetch and passes it on for processing.
+    //
+    // Thread-safe
+    // Results of fetches that are no longer active, or that have been
+    // replaced by a newer fetch of the same tile, are ignored.
+    static void handleFetchResult(
         TileLoader& tileLoader,
         TileCoord coord,
-        QNetworkReply* reply);
+        quint64 fetchId,
+        TileFetchResult result);
 
+    // Decodes the tile and hands it over to be uploaded. fromDiskCache
+    // says where the bytes came from, in case they turn out to be corrupt.
     static void processTile(
         TileLoader& tileLoader,
         TileCoord coord,
         QByteArray byteArray,
-        bool writeToFile);
+        bool fromDiskCache);
 
     static void enqueueLoadingJobs(
         TileLoader& tileLoader,
         std::vector<TileCoord>&& jobs);
 
+    static void loadTileFromDiskOrSource(
+        TileLoader& tileLoader,
+        TileCoord coord);
+
+    // Loads the tile from the decoded tile cache, if it's there.
+    // Returns false if the tile still needs to be decoded.
+    static bool loadDecodedTileFromCache(
+        TileLoader& tileLoader,
+        TileCoord coord);
+
+    // Asks the source in the background whether a cached tile has changed,
+    // if the metadata it was cached with says it has gone stale.
+    // The cached tile keeps being used in the meantime.
+    static void revalidateIfStale(
+        TileLoader& tileLoader,
+        TileSource& tileSource,
+        TileCoord coord,
+        QByteArray const& cacheMetadata);
+    // Updates the disk cache with what the source said. Tiles that have
+    // already been loaded are left alone, they pick up the changes the
+    // next time they are loaded.
+    //
+    // Thread-safe
+    static void handleRevalidationResult(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        TileValidators const& oldValidators,
+        TileFetchResult result);
+
+    // Fetches a batch of tiles from a source that prefers batches,
+    // letting the source read them all in one go.
+    static void loadTilesFromSource(
+        TileLoader& tileLoader,
+        std::vector<TileCoord> coords);
+
+    // Which thread pool a job runs on.
+    enum class JobKind {
+        // Blocking disk access.
+        Io,
+        // Decoding and triangulation.
+        Cpu,
+    };
+
+    // Queues up a job on the thread pool for the given kind. Jobs are not
+    // executed in the order they are scheduled, instead every free thread
+    // picks the most urgent job of its kind based on the current focus.
+    //
+    // Thread-safe
+    static void scheduleJob(
+        TileLoader& tileLoader,
+        JobKind kind,
+        TileCoord coord,
+        std::function<void()>&& fn);
+    static void runMostUrgentJob(TileLoader& tileLoader, JobKind kind);
+    // Empties the pending jobs of both kinds, for when we're shutting down.
+    // Jobs scheduled after this are dropped right away.
+    //
+    // Thread-safe
+    static void dropPendingJobs(TileLoader& tileLoader);
+
+    // Loads the index of the disk cache in the background, so that
+    // enqueueLoadingJobs can route tiles without touching the disk.
+    //
+    // Thread-safe
+    static void scheduleDiskCacheOpen(TileLoader& tileLoader);
+
+    // Lets the tile source order its fetches the same way as our jobs,
+    // and report the progress of its fetches.
+    // With attach set to false, the source stops calling back into us.
+    //
+    // Thread-safe
+    static void attachTileSource(TileLoader& tileLoader, TileSource* tileSource, bool attach);
+
+    // Evicts and compacts the disk cache in the background.
+    //
+    // Thread-safe
+    static void scheduleDiskCacheMaintenance(TileLoader& tileLoader);
+
+    // Queues the tile up to be written into the given disk cache in the
+    // background. Replaces any write for the same tile that is still waiting.
+    //
+    // Thread-safe
+    static void writeToDiskCache(
+        TileLoader& tileLoader,
+        std::shared_ptr<TileDiskCache> const& diskCache,
+        TileCoord coord,
+        TileDiskCache::EntryKind kind,
+        QByteArray const& bytes,
+        QByteArray const& metadata = {});
+    // Queues up a replacement of the metadata of a tile that is already in
+    // the disk cache. It goes through the same queue as writeToDiskCache, so it
+    // can't overtake a write of the same tile, nor be overtaken by one.
+    //
+    // Thread-safe
+    static void updateDiskCacheMetadata(
+        TileLoader& tileLoader,
+        std::shared_ptr<TileDiskCache> const& diskCache,
+        TileCoord coord,
+        QByteArray const& metadata);
+    // Writes everything that is waiting in m_pendingCacheWrites,
+    // until there's nothing left.
+    static void runCacheWriteBack(TileLoader& tileLoader);
+
+    // Lower value means more urgent.
+    // _pendingJobsLock must be held.
+    static double calcJobPriority(TileLoader const& tileLoader, TileCoord coord);
+
+    // Moves the focus of the scheduler to the given set of visible tiles.
+    // This effectively re-ranks all pending jobs.
+    //
+    // Thread-safe
+    static void updateJobFocus(TileLoader& tileLoader, QSpan<TileCoord const> visibleTiles);
+
     struct DecodedTile {
         std::vector<TilePendingLayer> layers;
         std::vector<QVector2D> vertices;
@@ -35,6 +171,188 @@ public:
     static std::optional<DecodedTile> decodeTileLayers(
         TileLoader& tileLoader,
         QByteArray bytes);
+    // Decodes a single layer, appending it to decodedTile.
+    // Returns false if the layer is malformed.
+    static bool decodeLayer(
+        vector_tile::Tile_Layer const& inLayer,
+        DecodedTile& decodedTile);
+
+    // Stores the decoded tile in the decoded tile cache
+    // and hands it over to be uploaded.
+    //
+    // Thread-safe
+    static void finishDecodedTile(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        DecodedTile&& decodedTile);
+
+    // Receives the bytes of a tile as they arrive from the tile source, and
+    // starts decoding every layer that has arrived completely.
+    //
+    // Thread-safe
+    static void handleFetchProgress(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        QByteArray const& bytesSoFar,
+        qint64 expectedSize);
+    // Schedules decoding of the layers in bytes that haven't been scheduled yet.
+    // Returns false if the bytes can't be split into layers.
+    //
+    // _streamingDecodesLock must be held.
+    static bool scheduleStreamedLayers(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        std::shared_ptr<StreamingDecode> const& streamingDecode,
+        QByteArray const& bytes);
+    static void decodeStreamedLayer(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        std::shared_ptr<StreamingDecode> const& streamingDecode,
+        size_t layerIndex,
+        QByteArray layerBytes);
+    // Called once the whole tile has arrived. Returns false if the tile
+    // has to be decoded the regular way after all.
+    //
+    // Thread-safe
+    static bool completeStreamingDecode(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        std::shared_ptr<StreamingDecode> const& streamingDecode,
+        QByteArray const& tileBytes);
+    // Puts the decoded layers together once they're all done.
+    static void finishStreamingDecode(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        std::shared_ptr<StreamingDecode> const& streamingDecode);
+
+    // Converts a decoded tile to and from the format of the decoded tile cache.
+    // Parsing returns std::nullopt if the bytes are corrupt, or were written
+    // by a different version of decodeTileLayers.
+    static QByteArray serializeDecodedTile(DecodedTile const& decodedTile);
+    static std::optional<DecodedTile> parseDecodedTile(QByteArray const& bytes);
+
+    // Hands the decoded tile over to be uploaded to the GPU.
+    // The tile must be Pending.
+    //
+    // Thread-safe
+    static void setTileReadyForUpload(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        DecodedTile&& decodedTile);
+
+    // Cancellation checkpoint for the loading pipeline.
+    //
+    // A Pending tile is obsolete when it was not part of the most recent
+    // call to requestTiles, meaning the user has panned or zoomed away from it.
+    // If the tile is obsolete, it's removed from the tile storage and this
+    // returns true. The caller then owns the cancellation and must drop
+    // the job without touching the tile storage again.
+    //
+    // Thread-safe
+    static bool cancelIfObsolete(TileLoader& tileLoader, TileCoord coord);
+    // Like cancelIfObsolete, but leaves the tile alone.
+    // Tiles that have already been removed count as obsolete.
+    static bool isObsolete(TileLoader const& tileLoader, TileCoord coord);
+
+    // Returns the tiles worth loading ahead of time, given the visible
+    // tiles and the current motion of the viewport. Most useful first.
+    static std::vector<TileCoord> calcPrefetchTiles(
+        QSpan<TileCoord const> visibleTiles,
+        ViewportMotion const& motion);
+
+    // Inserts Pending tiles for the prefetch candidates, as long as
+    // we are below the in-flight cap. Candidates that already exist
+    // are kept alive for another tick.
+    //
+    // _requestLock must be held.
+    static void prefetchTiles(
+        TileLoader& tileLoader,
+        ReadyTileSnapshot const& readyTiles,
+        QSpan<TileCoord const> candidates,
+        quint64 tick,
+        std::vector<TileCoord>& loadJobs);
+
+    // Finds the loaded tiles that can be drawn in place of a tile that
+    // is not ready yet. Prefers the children of the tile, since they are
+    // the most detailed, then falls back to the nearest ancestor.
+    static std::vector<TileLoaderRequestResult::FallbackTile> findFallbackTiles(
+        ReadyTileSnapshot const& readyTiles,
+        TileCoord coord,
+        quint64 tick);
+
+    // Thread-safe
+    static std::shared_ptr<ReadyTileSnapshot const> loadReadyTiles(TileLoader const& tileLoader) {
+        return std::atomic_load(&tileLoader.m_readyTiles);
+    }
+
+    // Publishes a new snapshot of the ready tiles with the given changes applied.
+    // Only the shards that are modified get copied.
+    //
+    // Must only be called on the render thread.
+    static void publishReadyTiles(
+        TileLoader& tileLoader,
+        std::vector<std::pair<quint64, std::shared_ptr<StoredTile const>>> const& added,
+        std::vector<quint64> const& removed);
+
+    // Moves a Pending tile into the Failed state. It will be retried with
+    // exponential backoff the next times it's requested. Tiles that are known
+    // to be missing are retried far less often, and are also remembered
+    // in the disk cache so we don't ask the tile server again after a restart.
+    //
+    // Thread-safe
+    static void markTileFailed(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        QString const& reason,
+        bool isKnownMissing);
+
+    // Adds the tile to the batch passed on the next tilesLoaded signal,
+    // and schedules the signal if it isn't already.
+    //
+    // Don't call this while holding a shard lock.
+    //
+    // Thread-safe
+    static void queueTileNotification(
+        TileLoader& tileLoader,
+        TileCoord coord,
+        bool success);
+
+    // Emits tilesLoaded with every tile that has finished since last time.
+    //
+    // Must be called on the TileLoader's thread.
+    static void flushTileNotifications(TileLoader& tileLoader);
+
+    // Cancels all active fetches whose tiles have become obsolete.
+    //
+    // Thread-safe
+    static void abortObsoleteFetches(TileLoader& tileLoader);
+
+    // Thread-safe
+    static void startFetch(TileLoader& tileLoader, TileSource& tileSource, TileCoord coord);
+
+    // Estimates how many bytes of CPU memory a finished tile is using.
+    static qint64 estimateTileCpuBytes(StoredTile const& tile);
+
+    // Evicts the least recently requested tiles until the memory usage
+    // is within the budgets, and the least recently requested Failed tiles
+    // until there are few enough of them. Tiles requested in the latest
+    // call to requestTiles are never evicted.
+    //
+    // Must be called on the render thread.
+    static void evictTilesOverBudget(TileLoader& tileLoader);
+    static void evictFailedTiles(TileLoader& tileLoader);
+
+    static int getShardIndex(quint64 packedKey) {
+        // Scramble the key so that neighbouring tiles, which have
+        // neighbouring keys, get spread out across all the shards.
+        quint64 hash = packedKey * 0x9E3779B97F4A7C15;
+        return (hash >> 32) % tileStorageShardCount;
+    }
+
+    // Returns the shard of the tile storage that holds the given key.
+    static TileStorageShard& getShard(TileLoader const& tileLoader, quint64 packedKey) {
+        return tileLoader.tileStorageShards[getShardIndex(packedKey)];
+    }
 
     static google::protobuf::Arena* getProtobufArena(TileLoader& tileLoader) {
         auto threadId = QThread::currentThreadId();
@@ -62,94 +380,330 @@ public:
 
 using TileLoaderImpl = TileLoader::TileLoaderImpl;
 
-static QString tileCoordToFilename(TileCoord coord) {
-    return QString("z%1x%2y%3.mvt").arg(coord.level).arg(coord.x).arg(coord.y);
+// An immutable view of every tile that is ReadyToRender.
+//
+// A new snapshot is published whenever tiles are uploaded or evicted.
+// Readers grab the current snapshot and can look up tiles in it without
+// taking any locks. Every TileLoaderRequestResult keeps its snapshot alive,
+// so an evicted tile is only destroyed once every frame that referenced it
+// has released its result.
+class TileLoader::ReadyTileSnapshot {
+public:
+    using ShardMap = std::unordered_map<quint64, std::shared_ptr<StoredTile const>>;
+    // Split up the same way as the tile storage, so that publishing
+    // a change only needs to copy the shards that were modified.
+    std::array<std::shared_ptr<ShardMap const>, tileStorageShardCount> shards;
+
+    [[nodiscard]] StoredTile const* find(TileCoord coord) const {
+        auto packedKey = coord.toPackedKey();
+        auto const& shard = *shards[TileLoaderImpl::getShardIndex(packedKey)];
+        auto tileIt = shard.find(packedKey);
+        return tileIt != shard.end() ? tileIt->second.get() : nullptr;
+    }
+};
+
+class TileLoader::StreamingDecode {
+public:
+    // IMPORTANT: These variables are ONLY available when _streamingDecodesLock is locked.
+    //
+    // How far into the tile we've looked for complete layers.
+    qsizetype scannedBytes = 0;
+    // The decoded layers, in the order they appear in the tile.
+    // Each is std::nullopt until its job has finished.
+    std::vector<std::optional<TileLoaderImpl::DecodedTile>> layers;
+    int layersInProgress = 0;
+    // Set if a layer couldn't be decoded, in which case
+    // the whole tile is decoded the regular way instead.
+    bool failed = false;
+    // Set once the whole tile has arrived.
+    bool isComplete = false;
+    QByteArray tileBytes;
+};
+
+// Decoding a tile while it downloads only pays off when the download takes
+// a while. Anything smaller than this is decoded in one go once it's done.
+static constexpr qint64 streamingDecodeMinBytes = 256 * 1024;
+
+// Reads a protobuf varint. Returns false if the bytes end before it does.
+static bool readProtobufVarint(uchar const*& it, uchar const* end, quint64& outValue)
+{
+    outValue = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (it == end) {
+            return false;
+        }
+        uchar byte = *it++;
+        outValue |= quint64(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
-bool writeNewFileHelper(const QString& path, const QByteArray &bytes)
+// Finds the layers that have arrived completely, starting at offset.
+// Each layer is a length-delimited field at the top level of the tile.
+// Advances offset past the last complete field.
+//
+// Returns false if the bytes can't be the start of a tile.
+static bool findCompleteTileLayers(
+    QByteArray const& bytes,
+    qsizetype& offset,
+    std::vector<std::pair<qsizetype, qsizetype>>& outLayers)
 {
-    auto fileInfo = QFileInfo{ path };
-    // Grab the directory part of this full filepath.
-    QDir dir = fileInfo.dir();
+    constexpr quint64 layersFieldNumber = 3;
+    auto begin = reinterpret_cast<uchar const*>(bytes.constData());
+    auto end = begin + bytes.size();
+    while (offset < bytes.size()) {
+        auto it = begin + offset;
+        quint64 tag = 0;
+        if (!readProtobufVarint(it, end, tag)) {
+            return true;
+        }
+        quint64 fieldLength = 0;
+        switch (tag & 0x7) {
+        case 0: {
+            quint64 value = 0;
+            if (!readProtobufVarint(it, end, value)) {
+                return true;
+            }
+            break;
+        }
+        case 1:
+            fieldLength = 8;
+            break;
+        case 2:
+            if (!readProtobufVarint(it, end, fieldLength)) {
+                return true;
+            }
+            break;
+        case 5:
+            fieldLength = 4;
+            break;
+        default:
+            return false;
+        }
+        if (fieldLength > quint64(end - it)) {
+            // Not all here yet.
+            return true;
+        }
 
-    // QFile won't create our directories for us.
-    // We gotta make them ourselves.
-    if (!dir.exists() && !dir.mkpath(dir.absolutePath())) {
-        return false;
+        if ((tag >> 3) == layersFieldNumber && (tag & 0x7) == 2) {
+            outLayers.push_back({ qsizetype(it - begin), qsizetype(fieldLength) });
+        }
+        offset = qsizetype(it - begin) + qsizetype(fieldLength);
     }
+    return true;
+}
 
-    // QFile won't create our directories for us.
-    // We gotta make them ourselves.
-    if (!dir.exists() && !dir.mkpath(dir.absolutePath())) {
-        return false;
-    }
+// The cache name comes from TileSource::getCacheName.
+static QString diskCacheDirectory(QString const& cacheName) {
+    QString basePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    return QDir::cleanPath(
+        basePath + QDir::separator() +
+        "tilecache" + QDir::separator() +
+        cacheName);
+}
 
-    QFile file { fileInfo.absoluteFilePath() };
-    if (file.exists()) {
-        return false;
+static std::shared_ptr<TileDiskCache> createDiskCache(TileSource const* tileSource, qint64 budgetBytes) {
+    if (tileSource == nullptr || !tileSource->isCacheable()) {
+        return nullptr;
     }
+    // The raw tiles compress well. The decoded tiles are mostly vertices,
+    // and are meant to be copied straight out of the mapping, so they're left alone.
+    auto diskCache = std::make_shared<TileDiskCache>(
+        diskCacheDirectory(tileSource->getCacheName()),
+        TileDiskCache::Compression::Zstd);
+    diskCache->setBudgetBytes(budgetBytes / 2);
+    return diskCache;
+}
 
-    /* Possible improvement:
-     * It's conceivable that a thread might try to read a tile-file
-     * that is currently being written to by another thread.
-     *
-     * To solve this, we might want to introduce a .lock file
-     * solution whose presence determines whether a file is currently
-     * in use.
-     */
+// Bump this whenever the output of decodeTileLayers changes. Decoded tiles are
+// cached per version, so old ones are never loaded by a newer decoder.
+static constexpr quint32 tileDecoderVersion = 1;
 
-    if (!file.open(QFile::WriteOnly)) {
-        return false;
-    }
+static QString decodedTileCacheName(QString const& cacheName, quint32 decoderVersion) {
+    return QString("%1_decoded_v%2").arg(cacheName).arg(decoderVersion);
+}
 
-    if (file.write(bytes) != bytes.length()) {
-        return false;
+static std::shared_ptr<TileDiskCache> createDecodedTileCache(TileSource const* tileSource, qint64 budgetBytes) {
+    if (tileSource == nullptr || !tileSource->isCacheable()) {
+        return nullptr;
     }
-
-    return true;
+    auto cacheName = decodedTileCacheName(tileSource->getCacheName(), tileDecoderVersion);
+    auto diskCache = std::make_shared<TileDiskCache>(diskCacheDirectory(cacheName));
+    diskCache->setBudgetBytes(budgetBytes / 2);
+    return diskCache;
 }
 
-static QString makeGetTileUrl(TileCoord coord, QString const& key) {
-    QString url = "https://api.maptiler.com/tiles/v3/{z}/{x}/{y}.pbf?key=";
+// Deletes the decoded tile caches left behind by older decoder versions.
+static void removeStaleDecodedTileCaches(QString const& cacheName) {
+    QDir baseDir { diskCacheDirectory({}) };
+    auto pattern = cacheName + "_decoded_v*";
+    auto currentName = decodedTileCacheName(cacheName, tileDecoderVersion);
+    for (auto const& dirName : baseDir.entryList({ pattern }, QDir::Dirs | QDir::NoDotAndDotDot)) {
+        if (dirName != currentName) {
+            QDir{ baseDir.filePath(dirName) }.removeRecursively();
+        }
+    }
+}
 
-    url = url.replace("{x}", QString::number(coord.x));
-    url = url.replace("{y}", QString::number(coord.y));
-    url = url.replace("{z}", QString::number(coord.level));
-    url = url.append(key);
+// Layout of a tile in the decoded tile cache:
+//
+//   DecodedTileHeader
+//   vertices, as pairs of floats
+//   indices, as 32-bit integers
+//   layers, features and their metadata, written with QDataStream
+//
+// The vertices and indices are stored exactly as they get uploaded to the GPU,
+// so loading them is a single copy out of the mapped segment file. The cache
+// never leaves this machine, so everything is in native byte order.
+struct DecodedTileHeader {
+    char magic[4];
+    quint32 decoderVersion;
+    quint32 vertexCount;
+    quint32 indexCount;
+};
+static constexpr char decodedTileMagic[4] = { 'T', 'D', 'C', '1' };
+
+// Eviction and compaction are kicked off after this many writes to the disk cache.
+static constexpr int diskCacheWritesBetweenMaintenance = 512;
+
+// How long to wait before the first retry of a failed tile.
+// This doubles for every consecutive failure.
+static constexpr qint64 tileRetryBaseDelayMs = 1000;
+static constexpr qint64 tileRetryMaxDelayMs = 5 * 60 * 1000;
+// How long to wait before asking the tile source again for a tile it told us doesn't exist.
+static constexpr qint64 missingTileRetryDelayMs = 24 * 60 * 60 * 1000;
+// Failed tiles are remembered so their backoff holds. Past this many, the least
+// recently requested ones are forgotten, down to half of this.
+static constexpr int maxFailedTiles = 4096;
+// How long the negative entries in the disk cache are valid.
+static constexpr qint64 missingTileDiskCacheLifetimeSecs = 7 * 24 * 60 * 60;
+// How long a tile stays fresh if the source didn't say.
+static constexpr qint64 defaultTileLifetimeSecs = 7 * 24 * 60 * 60;
+
+// Bumped whenever the format of the validators in the disk cache changes.
+static constexpr quint8 tileValidatorsVersion = 1;
+
+// Converts the validators of a tile to and from the metadata
+// it's stored with in the disk cache.
+static QByteArray serializeTileValidators(TileValidators validators)
+{
+    if (validators.expiresAtSecs == 0) {
+        validators.expiresAtSecs = QDateTime::currentSecsSinceEpoch() + defaultTileLifetimeSecs;
+    }
+    QByteArray bytes;
+    QDataStream stream { &bytes, QIODevice::WriteOnly };
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << tileValidatorsVersion << validators.expiresAtSecs << validators.etag << validators.lastModified;
+    return bytes;
+}
 
-    return url;
+static std::optional<TileValidators> parseTileValidators(QByteArray const& bytes)
+{
+    QDataStream stream { bytes };
+    stream.setVersion(QDataStream::Qt_6_0);
+    quint8 version = 0;
+    TileValidators validators;
+    stream >> version >> validators.expiresAtSecs >> validators.etag >> validators.lastModified;
+    if (stream.status() != QDataStream::Ok || version != tileValidatorsVersion) {
+        return std::nullopt;
+    }
+    return validators;
 }
 
 TileLoader::TileLoader(QObject *parent) : QObject{ parent }
 {
-#ifdef MAPTILER_KEY
-    m_maptilerKey = MAPTILER_KEY;
-#endif
-    if (m_maptilerKey == "") {
-        // Check for the environment variable for MapTiler key.
-        m_maptilerKey = qEnvironmentVariable("MAPTILER_KEY");
+    // Pick a default tile source. TILE_SOURCE_PMTILES, TILE_SOURCE_MBTILES and
+    // TILE_SOURCE_DIR let us run the whole pipeline offline against local tiles.
+    // TILE_SOURCE_URL points it at any tile server, like the mock_tile_server.
+    auto tileUrlTemplate = qEnvironmentVariable("TILE_SOURCE_URL");
+    auto localTileDir = qEnvironmentVariable("TILE_SOURCE_DIR");
+    auto mbTilesPath = qEnvironmentVariable("TILE_SOURCE_MBTILES");
+    auto pmTilesPath = qEnvironmentVariable("TILE_SOURCE_PMTILES");
+    if (pmTilesPath != "") {
+        auto* pmTilesSource = new PmTilesTileSource(this);
+        pmTilesSource->setPath(pmTilesPath);
+        m_tileSource = pmTilesSource;
+    } else if (mbTilesPath != "") {
+        auto* mbTilesSource = new MbTilesTileSource(this);
+        mbTilesSource->setPath(mbTilesPath);
+        m_tileSource = mbTilesSource;
+    } else if (localTileDir != "") {
+        auto* localSource = new LocalDirectoryTileSource(this);
+        localSource->setPath(localTileDir);
+        m_tileSource = localSource;
+    } else if (tileUrlTemplate != "") {
+        auto* httpSource = new HttpTileSource(this);
+        httpSource->setUrlTemplate(tileUrlTemplate);
+        // Every server gets a disk cache of its own.
+        auto urlHash = QCryptographicHash::hash(tileUrlTemplate.toUtf8(), QCryptographicHash::Sha1);
+        httpSource->setCacheName("url_" + QString::fromLatin1(urlHash.toHex().left(16)));
+        m_tileSource = httpSource;
+    } else {
+        m_tileSource = HttpTileSource::createMapTilerSource(this);
+    }
+    m_diskCache = createDiskCache(m_tileSource, m_diskCacheBudget);
+    m_decodedTileCache = createDecodedTileCache(m_tileSource, m_diskCacheBudget);
+    TileLoaderImpl::attachTileSource(*this, m_tileSource, true);
+
+    if (m_tileSource == nullptr) {
+        qWarning() <<
+            "No tile source available. Set a MapTiler key, TILE_SOURCE_URL, TILE_SOURCE_DIR, "
+            "TILE_SOURCE_MBTILES, TILE_SOURCE_PMTILES, or the tileSource property.";
     }
 
-    if (m_maptilerKey == "") {
-        qFatal("Failed to load MapTiler key.");
+    // Disk access mostly waits, so it doesn't need a thread per core.
+    // The CPU pool keeps QThreadPool's default of one thread per core.
+    m_ioThreadPool.setMaxThreadCount(4);
+    m_maintenanceThreadPool.setMaxThreadCount(1);
+    m_maintenanceThreadPool.setThreadPriority(QThread::LowestPriority);
+    m_writeBackThreadPool.setMaxThreadCount(1);
+    m_writeBackThreadPool.setThreadPriority(QThread::LowPriority);
+
+    TileLoaderImpl::scheduleDiskCacheOpen(*this);
+    // The budget might have been lowered since last run.
+    TileLoaderImpl::scheduleDiskCacheMaintenance(*this);
+
+    auto emptySnapshot = std::make_shared<ReadyTileSnapshot>();
+    for (auto& shard : emptySnapshot->shards) {
+        shard = std::make_shared<ReadyTileSnapshot::ShardMap const>();
     }
+    m_readyTiles = std::move(emptySnapshot);
 }
 
 TileLoaderUploadResult* TileLoader::uploadPendingTilesToRhi(QRhi* rhi, QRhiResourceUpdateBatch* batch)
 {
     auto* returnVal = new TileLoaderUploadResult();
 
-    auto autoLock = std::lock_guard{ *this->_tileMemoryLock };
+    // Grab the list of tiles that are ReadyForGpuUpload.
+    std::vector<TileCoord> readyCoords;
+    {
+        auto autoLock = std::lock_guard{ *this->_readyForUploadLock };
+        readyCoords.swap(tilesReadyForUpload);
+    }
+
+    // The tiles that will be added to the snapshot of ready tiles.
+    std::vector<std::pair<quint64, std::shared_ptr<StoredTile const>>> uploadedTiles;
+    uploadedTiles.reserve(readyCoords.size());
 
     // Loop through our list of jobs, upload them to GPU and store them
     // our actual storage.
-
-    // Find all tiles that are listed as ReadyToUploadToGpu
-    for (auto& keyVal : tileStorage) {
-        auto& tile = *keyVal.second;
-        if (tile.state != TileProgressState::ReadyForGpuUpload) {
-            continue;
+    for (auto const& coord : readyCoords) {
+        auto packedKey = coord.toPackedKey();
+        auto& shard = TileLoaderImpl::getShard(*this, packedKey);
+        auto autoLock = std::lock_guard{ shard.lock };
+
+        // Tiles that are ReadyForGpuUpload are never removed by anyone
+        // but us, so it has to be here.
+        auto tileIt = shard.tiles.find(packedKey);
+        if (tileIt == shard.tiles.end() ||
+            tileIt->second->state != TileProgressState::ReadyForGpuUpload)
+        {
+            qFatal("Tried to upload a tile that was not ReadyForGpuUpload.");
         }
+        auto& tile = *tileIt->second;
 
         // Create the buffers and schedule the transfer.
         auto vtxBuffer = rhi->newBuffer(
@@ -213,22 +767,280 @@ TileLoaderUploadResult* TileLoader::uploadPendingTilesToRhi(QRhi* rhi, QRhiResou
         // Finally, change this tile's state to ready to render.
         tile.layersForGpuUpload = {};
         tile.state = TileProgressState::ReadyToRender;
+
+        // Track the memory usage of this tile now that it has its final form.
+        tile.cpuByteSize = TileLoaderImpl::estimateTileCpuBytes(tile);
+        tile.gpuByteSize = vtxBuffer->size() + idxBuffer->size();
+        cpuBytesInUse += tile.cpuByteSize;
+        gpuBytesInUse += tile.gpuByteSize;
+
+        uploadedTiles.push_back({ packedKey, tileIt->second });
+    }
+
+    if (!uploadedTiles.empty()) {
+        TileLoaderImpl::publishReadyTiles(*this, uploadedTiles, {});
     }
 
+    TileLoaderImpl::evictTilesOverBudget(*this);
+
     return returnVal;
 }
 
-TileLoaderRequestResult* TileLoader::requestTiles(QSpan<TileCoord const> requestedTiles)
+qint64 TileLoaderImpl::estimateTileCpuBytes(StoredTile const& tile)
+{
+    // This does not need to be exact, it only needs to be
+    // in the right ballpark for the eviction policy to work.
+    // Every node in a std::map costs roughly three pointers and a color flag.
+    constexpr qint64 mapNodeOverhead = 4 * sizeof(void*);
+
+    auto stringBytes = [](QString const& string) -> qint64 {
+        return string.capacity() * sizeof(QChar);
+    };
+
+    qint64 total = sizeof(StoredTile);
+    total += tile.layers.capacity() * sizeof(TileLayer);
+    for (auto const& layer : tile.layers) {
+        total += stringBytes(layer.name);
+        total += layer.features.capacity() * sizeof(TileFeature);
+        for (auto const& feature : layer.features) {
+            for (auto const& [key, value] : feature.metaData) {
+                total += mapNodeOverhead + sizeof(key) + sizeof(value);
+                total += stringBytes(key);
+                if (value.typeId() == QMetaType::QString) {
+                    total += stringBytes(value.toString());
+                }
+            }
+        }
+    }
+    return total;
+}
+
+void TileLoaderImpl::evictTilesOverBudget(TileLoader& tileLoader)
+{
+    evictFailedTiles(tileLoader);
+
+    auto overBudget = [&]() {
+        bool cpuOver =
+            tileLoader.m_cpuMemoryBudget > 0 &&
+            tileLoader.cpuBytesInUse > tileLoader.m_cpuMemoryBudget;
+        bool gpuOver =
+            tileLoader.m_gpuMemoryBudget > 0 &&
+            tileLoader.gpuBytesInUse > tileLoader.m_gpuMemoryBudget;
+        return cpuOver || gpuOver;
+    };
+
+    if (!overBudget()) {
+        return;
+    }
+
+    // Tiles that are visible right now are off limits. Evicting them
+    // would only make us load them again right away.
+    quint64 currentTick = tileLoader.requestTick;
+
+    // Gather every tile that is allowed to be evicted.
+    // Pairs of (lastRequestedTick, packedKey).
+    auto readyTiles = loadReadyTiles(tileLoader);
+    std::vector<std::pair<quint64, quint64>> candidates;
+    for (auto const& shardMap : readyTiles->shards) {
+        for (auto const& [packedKey, tilePtr] : *shardMap) {
+            quint64 tick = tilePtr->lastRequestedTick;
+            if (tick < currentTick) {
+                candidates.push_back({ tick, packedKey });
+            }
+        }
+    }
+
+    // Least recently requested tiles first.
+    std::sort(
+        candidates.begin(),
+        candidates.end(),
+        [](auto const& a, auto const& b) { return a.first < b.first; });
+
+    std::vector<quint64> evictedKeys;
+    for (auto const& [tick, packedKey] : candidates) {
+        if (!overBudget()) {
+            break;
+        }
+        auto const& tile = *readyTiles->find(TileCoord::fromPackedKey(packedKey));
+        tileLoader.cpuBytesInUse -= tile.cpuByteSize;
+        tileLoader.gpuBytesInUse -= tile.gpuByteSize;
+        evictedKeys.push_back(packedKey);
+
+        auto& shard = getShard(tileLoader, packedKey);
+        auto autoLock = std::lock_guard{ shard.lock };
+        auto tileIt = shard.tiles.find(packedKey);
+        if (tileIt != shard.tiles.end() &&
+            tileIt->second->state == TileProgressState::ReadyToRender)
+        {
+            shard.tiles.erase(tileIt);
+        }
+    }
+
+    // The tiles themselves are only destroyed once the last snapshot
+    // pointing to them is released. The QRhi defers the release of the native
+    // buffers until the frames using them are done, so this is safe.
+    if (!evictedKeys.empty()) {
+        publishReadyTiles(tileLoader, {}, evictedKeys);
+    }
+}
+
+void TileLoaderImpl::evictFailedTiles(TileLoader& tileLoader)
+{
+    if (tileLoader.failedTileCount <= maxFailedTiles) {
+        return;
+    }
+
+    quint64 currentTick = tileLoader.requestTick;
+
+    // Pairs of (lastRequestedTick, packedKey).
+    std::vector<std::pair<quint64, quint64>> candidates;
+    for (int i = 0; i < tileStorageShardCount; i++) {
+        auto& shard = tileLoader.tileStorageShards[i];
+        auto autoLock = std::lock_guard{ shard.lock };
+        for (auto const& [packedKey, tilePtr] : shard.tiles) {
+            quint64 tick = tilePtr->lastRequestedTick;
+            if (tilePtr->state == TileProgressState::Failed && tick < currentTick) {
+                candidates.push_back({ tick, packedKey });
+            }
+        }
+    }
+
+    std::sort(
+        candidates.begin(),
+        candidates.end(),
+        [](auto const& a, auto const& b) { return a.first < b.first; });
+
+    // Going down to half means we don't have to scan again for a while.
+    for (auto const& [tick, packedKey] : candidates) {
+        if (tileLoader.failedTileCount <= maxFailedTiles / 2) {
+            break;
+        }
+        auto& shard = getShard(tileLoader, packedKey);
+        auto autoLock = std::lock_guard{ shard.lock };
+        auto tileIt = shard.tiles.find(packedKey);
+        if (tileIt != shard.tiles.end() &&
+            tileIt->second->state == TileProgressState::Failed)
+        {
+            shard.tiles.erase(tileIt);
+            tileLoader.failedTileCount--;
+        }
+    }
+}
+
+void TileLoaderImpl::publishReadyTiles(
+    TileLoader& tileLoader,
+    std::vector<std::pair<quint64, std::shared_ptr<StoredTile const>>> const& added,
+    std::vector<quint64> const& removed)
+{
+    using ShardMap = ReadyTileSnapshot::ShardMap;
+
+    auto oldSnapshot = loadReadyTiles(tileLoader);
+    auto newSnapshot = std::make_shared<ReadyTileSnapshot>(*oldSnapshot);
+
+    // Copies of the shards we are modifying. Any shard we don't
+    // touch is shared with the old snapshot.
+    std::array<std::shared_ptr<ShardMap>, tileStorageShardCount> modifiedShards;
+    auto getModifiedShard = [&](quint64 packedKey) -> ShardMap& {
+        auto index = getShardIndex(packedKey);
+        if (modifiedShards[index] == nullptr) {
+            modifiedShards[index] = std::make_shared<ShardMap>(*oldSnapshot->shards[index]);
+        }
+        return *modifiedShards[index];
+    };
+
+    for (auto const& [packedKey, tile] : added) {
+        getModifiedShard(packedKey).insert({ packedKey, tile });
+    }
+    for (auto const& packedKey : removed) {
+        getModifiedShard(packedKey).erase(packedKey);
+    }
+
+    for (int i = 0; i < tileStorageShardCount; i++) {
+        if (modifiedShards[i] != nullptr) {
+            newSnapshot->shards[i] = std::move(modifiedShards[i]);
+        }
+    }
+
+    std::atomic_store(
+        &tileLoader.m_readyTiles,
+        std::shared_ptr<ReadyTileSnapshot const>{ std::move(newSnapshot) });
+}
+
+qint64 TileLoader::getCpuMemoryBudget() const
+{
+    return m_cpuMemoryBudget;
+}
+
+void TileLoader::setCpuMemoryBudget(qint64 newValue)
+{
+    bool changed = m_cpuMemoryBudget.exchange(newValue) != newValue;
+    if (changed) {
+        emit cpuMemoryBudgetChanged();
+    }
+}
+
+qint64 TileLoader::getGpuMemoryBudget() const
+{
+    return m_gpuMemoryBudget;
+}
+
+void TileLoader::setGpuMemoryBudget(qint64 newValue)
+{
+    bool changed = m_gpuMemoryBudget.exchange(newValue) != newValue;
+    if (changed) {
+        emit gpuMemoryBudgetChanged();
+    }
+}
+
+TileLoaderRequestResult* TileLoader::requestTiles(
+    QSpan<TileCoord const> requestedTiles,
+    bool includeFallbacks)
 {
-    // TODO: deduplicate input list
+    // Duplicates in the input list are harmless. The first occurrence
+    // inserts a Pending tile, so any later occurrence finds it
+    // and won't queue a second load job.
     std::vector<TileCoord> loadJobs;
+    bool visibleSetChanged = false;
+    bool prefetchSetChanged = false;
 
     auto* outResult = new TileLoaderRequestResult();
 
+    // Everything we return comes from this snapshot. Holding on to it
+    // means none of the tiles can be destroyed while the result is alive.
+    auto readyTiles = TileLoaderImpl::loadReadyTiles(*this);
+    outResult->m_snapshot = readyTiles;
+
     // Create scope for the mutex lock.
     {
-        auto autoLock =  std::lock_guard{ *this->_tileMemoryLock };
+        auto requestLock = std::lock_guard{ *this->_requestLock };
+
+        // Bumping the tick makes every Pending tile that isn't part of this
+        // request obsolete. The new tick is only published once every
+        // requested tile has been stamped with it. That way a cancellation
+        // checkpoint running in the meantime never sees a requested tile as obsolete.
+        quint64 newTick = requestTick + 1;
+
+        // If the set actually changed, any active downloads
+        // of tiles that are no longer visible need to be aborted.
+        visibleSetChanged = !std::equal(
+            requestedTiles.begin(),
+            requestedTiles.end(),
+            lastRequestedCoords.begin(),
+            lastRequestedCoords.end());
+        if (visibleSetChanged) {
+            lastRequestedCoords.assign(requestedTiles.begin(), requestedTiles.end());
+        }
         for (auto const& requestedCoord : requestedTiles) {
+            // Fast path, the tile is ready. No locking needed.
+            if (auto readyTile = readyTiles->find(requestedCoord)) {
+                readyTile->lastRequestedTick = newTick;
+                outResult->tiles.insert({ requestedCoord, readyTile });
+                continue;
+            }
+
+            auto packedKey = requestedCoord.toPackedKey();
+            auto& shard = TileLoaderImpl::getShard(*this, packedKey);
+            auto autoLock = std::lock_guard{ shard.lock };
 
             // Check if the requested coord is already loaded.
             // A tile can be in the state of:
@@ -238,33 +1050,78 @@ TileLoaderRequestResult* TileLoader::requestTiles(QSpan<TileCoord const> request
 
             // We are not checking if our
             // tile is already in the processing stage!
-            auto tileIt = tileStorage.find(requestedCoord);
-            if (tileIt != tileStorage.end()) {
-                auto const& tile = *tileIt->second;
-                if (tile.state == TileProgressState::ReadyToRender) {
-                    // Tile is ready.
-                    // Return it from this function.
-                    outResult->tiles.insert({ requestedCoord, &tile });
-
-                    // Note: The user might eventually want to know
-                    // about tiles that are failed also?
+            auto tileIt = shard.tiles.find(packedKey);
+            if (tileIt != shard.tiles.end()) {
+                // If the tile exists in memory but is not in the snapshot,
+                // it means it's otherwise being processed, or it has failed.
+                // We only need to make sure it doesn't get cancelled.
+                //
+                // Note: The user might eventually want to know
+                // about tiles that are failed also?
+                auto& tile = *tileIt->second;
+                tile.lastRequestedTick = newTick;
+
+                // It's not speculative anymore, so it stops counting towards the prefetch limit.
+                if (tile.state == TileProgressState::Pending && tile.isPrefetch) {
+                    tile.isPrefetch = false;
+                    prefetchTilesInFlight--;
                 }
 
-                // If the tile exists in memory but is not ready to render,
-                // it means it's otherwise being processed.
-                // We can ignore this result.
+                // Failed tiles get another go once their backoff has passed.
+                if (tile.state == TileProgressState::Failed && tile.retryDeadline.hasExpired()) {
+                    tile.state = TileProgressState::Pending;
+                    failedTileCount--;
+                    loadJobs.push_back(requestedCoord);
+                }
             } else {
                 // Not found. Queue it for loading.
                 loadJobs.push_back(requestedCoord);
 
                 // Insert a new tile with state pending.
-                StoredTile newTileItem = {};
-                newTileItem.state = TileProgressState::Pending;
-                tileStorage.insert({
+                auto newTile = std::make_shared<StoredTile>();
+                newTile->state = TileProgressState::Pending;
+                newTile->lastRequestedTick = newTick;
+                shard.tiles.insert({ packedKey, std::move(newTile) });
+            }
+        }
+
+        if (includeFallbacks) {
+            for (auto const& requestedCoord : requestedTiles) {
+                if (outResult->tiles.count(requestedCoord) != 0 ||
+                    outResult->fallbacks.count(requestedCoord) != 0)
+                {
+                    continue;
+                }
+                auto fallbackTiles = TileLoaderImpl::findFallbackTiles(
+                    *readyTiles,
                     requestedCoord,
-                    std::make_unique<StoredTile>(std::move(newTileItem)) });
+                    newTick);
+                if (!fallbackTiles.empty()) {
+                    outResult->fallbacks.insert({ requestedCoord, std::move(fallbackTiles) });
+                }
             }
         }
+
+        std::vector<TileCoord> prefetchCandidates;
+        if (m_maxPrefetchTilesInFlight > 0) {
+            prefetchCandidates = TileLoaderImpl::calcPrefetchTiles(requestedTiles, m_viewportMotion);
+            TileLoaderImpl::prefetchTiles(*this, *readyTiles, prefetchCandidates, newTick, loadJobs);
+        }
+        // Prefetches that fell out of the candidates are aborted the same way
+        // as visible tiles, so they stop holding on to their prefetch slots.
+        prefetchSetChanged = prefetchCandidates != lastPrefetchCoords;
+        if (prefetchSetChanged) {
+            lastPrefetchCoords = std::move(prefetchCandidates);
+        }
+
+        requestTick = newTick;
+    }
+
+    if (visibleSetChanged) {
+        TileLoaderImpl::updateJobFocus(*this, requestedTiles);
+    }
+    if (visibleSetChanged || prefetchSetChanged) {
+        TileLoaderImpl::abortObsoleteFetches(*this);
     }
 
     // We have some load Jobs, fire them up.
@@ -275,132 +1132,1171 @@ TileLoaderRequestResult* TileLoader::requestTiles(QSpan<TileCoord const> request
     return outResult;
 }
 
-void TileLoaderImpl::enqueueLoadingJobs(TileLoader& tileLoader, std::vector<TileCoord>&& jobs) {
-    // All the following code runs on a separate thread. This function returns immediately.
-    tileLoader.m_threadPool.start([jobs = std::move(jobs), &tileLoader]() {
-
-        // For each tile we want to load, check if they're in
-        // disk cache. Every tile that is in disk cache can start
-        // being loaded on a thread immediately.
-        // Any tile that needs to be networked, needs to be queued up
-        // for download on the NetworkAccessManager's thread.
-
-        std::vector<TileCoord> tilesToDownload;
-
-        for (auto const& jobCoord : jobs) {
+std::vector<TileCoord> TileLoaderImpl::calcPrefetchTiles(
+    QSpan<TileCoord const> visibleTiles,
+    ViewportMotion const& motion)
+{
+    if (visibleTiles.empty()) {
+        return {};
+    }
 
-            QString basePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    // How far into the future we try to predict.
+    constexpr double lookaheadSeconds = 0.5;
+    // Stops a single fling from prefetching half the map.
+    constexpr int maxLookaheadTiles = 4;
+    // Zoom velocity below this is considered noise.
+    constexpr double zoomVelocityThreshold = 0.1;
 
-            auto dir = QDir::cleanPath(
-                basePath + QDir::separator() +
-                "tiles" + QDir::separator() +
-                "maptiler_planet" + QDir::separator() +
-                tileCoordToFilename(jobCoord));
+    int level = 0;
+    for (auto const& coord : visibleTiles) {
+        level = std::max(level, coord.level);
+    }
+    int minX = std::numeric_limits<int>::max();
+    int minY = std::numeric_limits<int>::max();
+    int maxX = std::numeric_limits<int>::min();
+    int maxY = std::numeric_limits<int>::min();
+    for (auto const& coord : visibleTiles) {
+        if (coord.level == level) {
+            minX = std::min(minX, coord.x);
+            minY = std::min(minY, coord.y);
+            maxX = std::max(maxX, coord.x);
+            maxY = std::max(maxY, coord.y);
+        }
+    }
+    int tileCount = 1 << level;
 
-            QFile file{ dir };
-            if (file.exists()) {
-                // Found the file. Move the processing onto a separate thread.
-                // One async task per tile.
-                //
-                // TODO: Move the following code into it's own function.
-                tileLoader.m_threadPool.start([=, &tileLoader]() {
-                    QFile file { dir };
-                    bool openSuccess = file.open(QFile::ReadOnly);
-                    if (!openSuccess) {
-                        // Found the file but unable to read it. Bug?
-
-                    }
-                    QByteArray tileBytes = file.readAll();
-                    TileLoaderImpl::processTile(
-                        tileLoader,
-                        jobCoord,
-                        tileBytes,
-                        false);
+    // Where the viewport will be, measured in tiles at this level.
+    auto lookahead = [&](double velocity) {
+        double shift = velocity * lookaheadSeconds * tileCount;
+        return std::clamp((int)std::round(shift), -maxLookaheadTiles, maxLookaheadTiles);
+    };
+    int shiftX = lookahead(motion.velocityX);
+    int shiftY = lookahead(motion.velocityY);
+
+    std::vector<TileCoord> out;
+
+    // A ring of one tile around the visible tiles,
+    // stretched in the direction we are moving.
+    int ringMinX = std::max(0, minX - 1 + std::min(0, shiftX));
+    int ringMaxX = std::min(tileCount - 1, maxX + 1 + std::max(0, shiftX));
+    int ringMinY = std::max(0, minY - 1 + std::min(0, shiftY));
+    int ringMaxY = std::min(tileCount - 1, maxY + 1 + std::max(0, shiftY));
+    for (int y = ringMinY; y <= ringMaxY; y++) {
+        for (int x = ringMinX; x <= ringMaxX; x++) {
+            bool isVisible = x >= minX && x <= maxX && y >= minY && y <= maxY;
+            if (!isVisible) {
+                out.push_back({ level, x, y });
+            }
+        }
+    }
 
-                });
+    // Tiles in the direction of movement are the most useful.
+    double centerX = (minX + maxX + 1) / 2.0 + shiftX;
+    double centerY = (minY + maxY + 1) / 2.0 + shiftY;
+    std::sort(out.begin(), out.end(), [&](TileCoord const& a, TileCoord const& b) {
+        auto distance = [&](TileCoord const& coord) {
+            return std::hypot(coord.x + 0.5 - centerX, coord.y + 0.5 - centerY);
+        };
+        return distance(a) < distance(b);
+    });
 
-            } else {
-                // File doesn't exist. Queue it for downloading.
-                tilesToDownload.push_back(jobCoord);
-            }
-        }
-
-        if (!tilesToDownload.empty()) {
-
-            // We are now on a thread inside the thread-pool.
-            // Downloads need to be invoked on the same thread as the NetworkAccessManager.
-            // Queue it up for execution.
-            QMetaObject::invokeMethod(
-                &tileLoader.m_networkAccessMgr,
-                [=, &tileLoader]() { // Capture by value to not get lifetime issues.
-
-                    // Create one request for every tile
-                    for (auto const& loadJobCoord : tilesToDownload) {
-
-                        QNetworkRequest req = { };
-                        auto url = makeGetTileUrl(loadJobCoord, tileLoader.m_maptilerKey);
-                        req.setUrl(QUrl{ url });
-
-                        // Handle the reply
-                        auto reply = tileLoader.m_networkAccessMgr.get(req);
-                        QObject::connect(
-                            reply,
-                            &QNetworkReply::finished,
-                            &tileLoader,
-                            [=, &tileLoader]() {
-                                // TODO error handling.
-                                TileLoaderImpl::handleNetworkReply(
-                                    tileLoader,
-                                    loadJobCoord,
-                                    reply);
-                            });
-                    }
-                });
+    // The next zoom level, if we're headed there.
+    if (motion.zoomVelocity > zoomVelocityThreshold && level < maxZoomLevel) {
+        for (int y = minY * 2; y <= maxY * 2 + 1; y++) {
+            for (int x = minX * 2; x <= maxX * 2 + 1; x++) {
+                out.push_back({ level + 1, x, y });
+            }
         }
-    });
+    } else if (motion.zoomVelocity < -zoomVelocityThreshold && level > 0) {
+        for (int y = minY / 2; y <= maxY / 2; y++) {
+            for (int x = minX / 2; x <= maxX / 2; x++) {
+                out.push_back({ level - 1, x, y });
+            }
+        }
+    }
+
+    return out;
 }
 
-void TileLoaderImpl::handleNetworkReply(
+void TileLoaderImpl::prefetchTiles(
+    TileLoader& tileLoader,
+    ReadyTileSnapshot const& readyTiles,
+    QSpan<TileCoord const> candidates,
+    quint64 tick,
+    std::vector<TileCoord>& loadJobs)
+{
+    for (auto const& coord : candidates) {
+        if (auto readyTile = readyTiles.find(coord)) {
+            readyTile->lastRequestedTick = tick;
+            continue;
+        }
+
+        auto packedKey = coord.toPackedKey();
+        auto& shard = getShard(tileLoader, packedKey);
+        auto autoLock = std::lock_guard{ shard.lock };
+
+        auto tileIt = shard.tiles.find(packedKey);
+        if (tileIt != shard.tiles.end()) {
+            // Already loaded or on its way. Make sure it's not cancelled.
+            auto& tile = *tileIt->second;
+            tile.lastRequestedTick = tick;
+
+            // Failed tiles get another go once their backoff has passed,
+            // the same as in requestTiles.
+            bool canRetry =
+                tile.state == TileProgressState::Failed &&
+                tile.retryDeadline.hasExpired() &&
+                tileLoader.prefetchTilesInFlight < tileLoader.m_maxPrefetchTilesInFlight;
+            if (canRetry) {
+                tile.state = TileProgressState::Pending;
+                tile.isPrefetch = true;
+                tileLoader.failedTileCount--;
+                tileLoader.prefetchTilesInFlight++;
+                loadJobs.push_back(coord);
+            }
+            continue;
+        }
+
+        if (tileLoader.prefetchTilesInFlight >= tileLoader.m_maxPrefetchTilesInFlight) {
+            continue;
+        }
+
+        auto newTile = std::make_shared<StoredTile>();
+        newTile->state = TileProgressState::Pending;
+        newTile->lastRequestedTick = tick;
+        newTile->isPrefetch = true;
+        shard.tiles.insert({ packedKey, std::move(newTile) });
+        tileLoader.prefetchTilesInFlight++;
+        loadJobs.push_back(coord);
+    }
+}
+
+void TileLoader::setViewportMotion(ViewportMotion motion)
+{
+    auto requestLock = std::lock_guard{ *this->_requestLock };
+    m_viewportMotion = motion;
+}
+
+int TileLoader::getMaxPrefetchTilesInFlight() const
+{
+    return m_maxPrefetchTilesInFlight;
+}
+
+void TileLoader::setMaxPrefetchTilesInFlight(int newValue)
+{
+    bool changed = m_maxPrefetchTilesInFlight.exchange(newValue) != newValue;
+    if (changed) {
+        emit maxPrefetchTilesInFlightChanged();
+    }
+}
+
+TileLoader::~TileLoader()
+{
+    // Everything that can call back into us has to be stopped before our members
+    // go away. The thread pools and the source would otherwise only stop once
+    // the members they use are already destroyed.
+    auto* tileSource = m_tileSource.load();
+    TileLoaderImpl::attachTileSource(*this, tileSource, false);
+
+    // Results of cancelled fetches are ignored once they're no longer active.
+    if (tileSource != nullptr) {
+        std::map<TileCoord, quint64> activeFetches;
+        {
+            auto autoLock = std::lock_guard{ *_activeFetchesLock };
+            std::swap(activeFetches, m_activeFetches);
+        }
+        for (auto const& [coord, fetchId] : activeFetches) {
+            tileSource->cancelFetch(coord);
+        }
+    }
+
+    // From here on no new jobs are accepted, so once the running ones are
+    // done, nothing holds on to bytes that are owned by the source.
+    TileLoaderImpl::dropPendingJobs(*this);
+    m_ioThreadPool.waitForDone();
+    m_cpuThreadPool.waitForDone();
+
+    // Destroying the source waits for whatever callbacks it's in the middle of.
+    if (tileSource != nullptr && tileSource->parent() == this) {
+        m_tileSource = nullptr;
+        delete tileSource;
+    }
+
+    // Pending cache writes are still written, so nothing we've paid for is lost.
+    m_writeBackThreadPool.waitForDone();
+    m_maintenanceThreadPool.waitForDone();
+}
+
+TileSource* TileLoader::getTileSource() const
+{
+    return m_tileSource;
+}
+
+void TileLoader::setTileSource(TileSource* newValue)
+{
+    if (newValue == m_tileSource) {
+        return;
+    }
+    if (requestTick > 0) {
+        qWarning() << "Changing the tile source after tiles have been requested is not supported.";
+        return;
+    }
+
+    auto* oldSource = m_tileSource.exchange(newValue);
+    TileLoaderImpl::attachTileSource(*this, oldSource, false);
+    if (newValue != nullptr) {
+        newValue->setParent(this);
+    }
+    TileLoaderImpl::attachTileSource(*this, newValue, true);
+    m_diskCache = createDiskCache(newValue, m_diskCacheBudget);
+    m_decodedTileCache = createDecodedTileCache(newValue, m_diskCacheBudget);
+    TileLoaderImpl::scheduleDiskCacheOpen(*this);
+    if (oldSource != nullptr && oldSource->parent() == this) {
+        oldSource->deleteLater();
+    }
+    emit tileSourceChanged();
+}
+
+qint64 TileLoader::getDiskCacheBudget() const
+{
+    return m_diskCacheBudget;
+}
+
+void TileLoader::setDiskCacheBudget(qint64 newValue)
+{
+    bool changed = m_diskCacheBudget.exchange(newValue) != newValue;
+    if (!changed) {
+        return;
+    }
+    if (m_diskCache != nullptr) {
+        m_diskCache->setBudgetBytes(newValue / 2);
+        m_decodedTileCache->setBudgetBytes(newValue / 2);
+        TileLoaderImpl::scheduleDiskCacheMaintenance(*this);
+    }
+    emit diskCacheBudgetChanged();
+}
+
+int TileLoader::getIoThreadCount() const
+{
+    return m_ioThreadPool.maxThreadCount();
+}
+
+void TileLoader::setIoThreadCount(int newValue)
+{
+    newValue = std::max(newValue, 1);
+    bool changed = m_ioThreadPool.maxThreadCount() != newValue;
+    m_ioThreadPool.setMaxThreadCount(newValue);
+    if (changed) {
+        emit ioThreadCountChanged();
+    }
+}
+
+int TileLoader::getCpuThreadCount() const
+{
+    return m_cpuThreadPool.maxThreadCount();
+}
+
+void TileLoader::setCpuThreadCount(int newValue)
+{
+    newValue = std::max(newValue, 1);
+    bool changed = m_cpuThreadPool.maxThreadCount() != newValue;
+    m_cpuThreadPool.setMaxThreadCount(newValue);
+    if (changed) {
+        emit cpuThreadCountChanged();
+    }
+}
+
+std::vector<TileLoaderRequestResult::FallbackTile> TileLoaderImpl::findFallbackTiles(
+    ReadyTileSnapshot const& readyTiles,
+    TileCoord coord,
+    quint64 tick)
+{
+    // Tiles in use as fallbacks count as recently requested, so they
+    // aren't evicted right when they are the most useful.
+    auto findReadyTile = [&](TileCoord coord) {
+        auto tile = readyTiles.find(coord);
+        if (tile != nullptr) {
+            tile->lastRequestedTick = tick;
+        }
+        return tile;
+    };
+
+    // Walks up the tile pyramid to find the closest ancestor of
+    // the given coord that is ready.
+    auto findAncestor = [&](TileCoord descendant) -> std::optional<TileLoaderRequestResult::FallbackTile> {
+        for (int level = descendant.level - 1; level >= 0; level--) {
+            int levelDiff = descendant.level - level;
+            TileCoord ancestorCoord = {
+                level,
+                descendant.x >> levelDiff,
+                descendant.y >> levelDiff };
+            auto ancestorTile = findReadyTile(ancestorCoord);
+            if (ancestorTile != nullptr) {
+                return TileLoaderRequestResult::FallbackTile{ ancestorCoord, ancestorTile, descendant };
+            }
+        }
+        return std::nullopt;
+    };
+
+    std::vector<TileLoaderRequestResult::FallbackTile> out;
+
+    // Typically the case when zooming out, the children
+    // of this tile are still loaded.
+    std::vector<TileCoord> missingChildren;
+    for (int i = 0; i < 4; i++) {
+        TileCoord childCoord = {
+            coord.level + 1,
+            coord.x * 2 + (i % 2),
+            coord.y * 2 + (i / 2) };
+        auto childTile = findReadyTile(childCoord);
+        if (childTile != nullptr) {
+            out.push_back({ childCoord, childTile, childCoord });
+        } else {
+            missingChildren.push_back(childCoord);
+        }
+    }
+
+    if (out.empty()) {
+        // Typically the case when zooming in. Cover the
+        // whole tile with one ancestor.
+        if (auto ancestor = findAncestor(coord)) {
+            out.push_back(ancestor.value());
+        }
+    } else {
+        // Fill the holes between the children with the ancestor,
+        // clipped to the area of each missing child.
+        for (auto const& childCoord : missingChildren) {
+            if (auto ancestor = findAncestor(childCoord)) {
+                out.push_back(ancestor.value());
+            }
+        }
+    }
+
+    return out;
+}
+
+void TileLoaderImpl::markTileFailed(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    QString const& reason,
+    bool isKnownMissing)
+{
+    qWarning() << "Failed to load tile" << coord.level << coord.x << coord.y << ":" << reason;
+
+    {
+        auto packedKey = coord.toPackedKey();
+        auto& shard = getShard(tileLoader, packedKey);
+        auto autoLock = std::lock_guard{ shard.lock };
+        auto tileIt = shard.tiles.find(packedKey);
+        if (tileIt == shard.tiles.end() || tileIt->second->state != TileProgressState::Pending) {
+            qFatal(
+                "Tried to set a tile as failed, "
+                "but existing tile-node was not in state 'Pending'.");
+        }
+        auto& tile = *tileIt->second;
+
+        tile.state = TileProgressState::Failed;
+        tileLoader.failedTileCount++;
+        tile.failureReason = reason;
+        tile.failureCount++;
+        tile.isKnownMissing = isKnownMissing;
+        if (isKnownMissing) {
+            tile.retryDeadline = QDeadlineTimer{ missingTileRetryDelayMs };
+        } else {
+            // Exponential backoff. Clamp the exponent so we don't overflow.
+            int exponent = std::min(tile.failureCount - 1, 20);
+            qint64 delayMs = std::min(tileRetryBaseDelayMs << exponent, tileRetryMaxDelayMs);
+            tile.retryDeadline = QDeadlineTimer{ delayMs };
+        }
+
+        if (tile.isPrefetch) {
+            tileLoader.prefetchTilesInFlight--;
+            tile.isPrefetch = false;
+        }
+    }
+
+    queueTileNotification(tileLoader, coord, false);
+}
+
+void TileLoaderImpl::queueTileNotification(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    bool success)
+{
+    bool needsScheduling = false;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._notifyLock };
+        if (success) {
+            tileLoader.m_loadedTilesToNotify.push_back(coord);
+        } else {
+            tileLoader.m_failedTilesToNotify.push_back(coord);
+        }
+        needsScheduling = !tileLoader.m_notifyScheduled;
+        tileLoader.m_notifyScheduled = true;
+    }
+
+    if (!needsScheduling) {
+        return;
+    }
+
+    // We can't start a timer from the thread-pool, so we hop over
+    // to the TileLoader's thread first.
+    QMetaObject::invokeMethod(
+        &tileLoader,
+        [&tileLoader]() {
+            qint64 sinceLastNotify = tileLoader.m_lastNotifyTimer.isValid() ?
+                tileLoader.m_lastNotifyTimer.elapsed() :
+                minNotifyIntervalMs;
+            auto delay = std::max<qint64>(0, minNotifyIntervalMs - sinceLastNotify);
+            QTimer::singleShot(
+                std::chrono::milliseconds{ delay },
+                &tileLoader,
+                [&tileLoader]() { flushTileNotifications(tileLoader); });
+        },
+        Qt::QueuedConnection);
+}
+
+void TileLoaderImpl::flushTileNotifications(TileLoader& tileLoader)
+{
+    QList<TileCoord> loadedTiles;
+    QList<TileCoord> failedTiles;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._notifyLock };
+        std::swap(loadedTiles, tileLoader.m_loadedTilesToNotify);
+        std::swap(failedTiles, tileLoader.m_failedTilesToNotify);
+        tileLoader.m_notifyScheduled = false;
+    }
+
+    tileLoader.m_lastNotifyTimer.start();
+    emit tileLoader.tilesLoaded(loadedTiles, failedTiles);
+}
+
+bool TileLoaderImpl::isObsolete(TileLoader const& tileLoader, TileCoord coord)
+{
+    auto packedKey = coord.toPackedKey();
+    auto& shard = getShard(tileLoader, packedKey);
+    auto autoLock = std::lock_guard{ shard.lock };
+    auto tileIt = shard.tiles.find(packedKey);
+    if (tileIt == shard.tiles.end()) {
+        return true;
+    }
+    auto const& tile = *tileIt->second;
+    return
+        tile.state == TileProgressState::Pending &&
+        tile.lastRequestedTick < tileLoader.requestTick;
+}
+
+bool TileLoaderImpl::cancelIfObsolete(TileLoader& tileLoader, TileCoord coord)
+{
+    auto packedKey = coord.toPackedKey();
+    auto& shard = getShard(tileLoader, packedKey);
+    auto autoLock = std::lock_guard{ shard.lock };
+    auto tileIt = shard.tiles.find(packedKey);
+    if (tileIt == shard.tiles.end()) {
+        qFatal("Tried to check a tile for cancellation, but couldn't find existing tile-node.");
+    }
+    auto const& tile = *tileIt->second;
+    if (tile.state != TileProgressState::Pending ||
+        tile.lastRequestedTick >= tileLoader.requestTick)
+    {
+        return false;
+    }
+
+    if (tile.isPrefetch) {
+        tileLoader.prefetchTilesInFlight--;
+    }
+    shard.tiles.erase(tileIt);
+    return true;
+}
+
+void TileLoaderImpl::abortObsoleteFetches(TileLoader& tileLoader)
+{
+    auto* tileSource = tileLoader.m_tileSource.load();
+    if (tileSource == nullptr) {
+        return;
+    }
+
+    std::vector<TileCoord> fetchesToCancel;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._activeFetchesLock };
+        for (auto it = tileLoader.m_activeFetches.begin(); it != tileLoader.m_activeFetches.end();) {
+            if (cancelIfObsolete(tileLoader, it->first)) {
+                fetchesToCancel.push_back(it->first);
+                it = tileLoader.m_activeFetches.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        // Layer jobs that haven't started yet see that the tile is gone and skip
+        // decoding. The ones already running finish, and their results are dropped.
+        auto streamingDecodesLock = std::lock_guard{ *tileLoader._streamingDecodesLock };
+        for (auto const& coord : fetchesToCancel) {
+            tileLoader.m_streamingDecodes.erase(coord);
+        }
+    }
+
+    // If the result of any of these fetches still comes through,
+    // handleFetchResult takes care of ignoring it.
+    for (auto const& coord : fetchesToCancel) {
+        tileSource->cancelFetch(coord);
+    }
+}
+
+void TileLoaderImpl::startFetch(TileLoader& tileLoader, TileSource& tileSource, TileCoord coord)
+{
+    quint64 fetchId = 0;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._activeFetchesLock };
+        fetchId = tileLoader.m_nextFetchId++;
+        tileLoader.m_activeFetches[coord] = fetchId;
+    }
+
+    tileSource.fetchTile(
+        coord,
+        [=, &tileLoader](TileFetchResult result) {
+            handleFetchResult(tileLoader, coord, fetchId, std::move(result));
+        });
+}
+
+void TileLoaderImpl::enqueueLoadingJobs(TileLoader& tileLoader, std::vector<TileCoord>&& jobs) {
+    // All the following code runs on a separate thread. This function returns immediately.
+    //
+    // For each tile we want to load, check if they're in
+    // disk cache. Every tile that is in disk cache can start
+    // being loaded on a thread immediately.
+    // Any tile that isn't, is fetched from the TileSource.
+    //
+    // Once the index of the disk cache is in memory, tiles we know
+    // aren't cached skip the I/O queue and are fetched right away.
+    //
+    // The jobs don't run in the order they are submitted, the scheduler
+    // always picks the most urgent one.
+    //
+    // Sources that prefer batches get the whole batch in one job instead.
+    auto* tileSource = tileLoader.m_tileSource.load();
+    if (tileSource != nullptr && tileSource->prefersBatchedFetches()) {
+        auto batchCoord = jobs.front();
+        scheduleJob(tileLoader, JobKind::Io, batchCoord, [=, &tileLoader, coords = std::move(jobs)]() {
+            loadTilesFromSource(tileLoader, coords);
+        });
+        return;
+    }
+
+    std::vector<TileCoord> uncachedTiles;
+    for (auto const& jobCoord : jobs) {
+        // The raw tile might have been evicted while the decoded one is still around.
+        bool isKnownUncached =
+            tileSource != nullptr &&
+            tileLoader.m_diskCache != nullptr &&
+            tileLoader.m_diskCache->tryContains(jobCoord) == false &&
+            tileLoader.m_decodedTileCache->tryContains(jobCoord) == false;
+        if (isKnownUncached) {
+            uncachedTiles.push_back(jobCoord);
+            continue;
+        }
+        scheduleJob(tileLoader, JobKind::Io, jobCoord, [=, &tileLoader]() {
+            loadTileFromDiskOrSource(tileLoader, jobCoord);
+        });
+    }
+
+    if (!uncachedTiles.empty()) {
+        {
+            auto autoLock = std::lock_guard{ *tileLoader._pendingJobsLock };
+            std::sort(
+                uncachedTiles.begin(),
+                uncachedTiles.end(),
+                [&](TileCoord a, TileCoord b) {
+                    return calcJobPriority(tileLoader, a) < calcJobPriority(tileLoader, b);
+                });
+        }
+        for (auto const& coord : uncachedTiles) {
+            startFetch(tileLoader, *tileSource, coord);
+        }
+    }
+}
+
+bool TileLoaderImpl::loadDecodedTileFromCache(TileLoader& tileLoader, TileCoord coord)
+{
+    auto cachedOpt = tileLoader.m_decodedTileCache->read(coord);
+    if (!cachedOpt.has_value()) {
+        return false;
+    }
+
+    // Parsing is little more than copying the vertices and indices out of
+    // the mapping, so it's done right here instead of going through the CPU queue.
+    auto decodedTileOpt = parseDecodedTile(cachedOpt->bytes);
+    if (!decodedTileOpt.has_value()) {
+        tileLoader.m_decodedTileCache->remove(coord);
+        return false;
+    }
+
+    setTileReadyForUpload(tileLoader, coord, std::move(decodedTileOpt.value()));
+    return true;
+}
+
+void TileLoaderImpl::loadTileFromDiskOrSource(TileLoader& tileLoader, TileCoord coord)
+{
+    // Don't even bother looking for tiles that
+    // are already out of view.
+    if (TileLoaderImpl::cancelIfObsolete(tileLoader, coord)) {
+        return;
+    }
+
+    auto* tileSource = tileLoader.m_tileSource.load();
+    if (tileSource == nullptr) {
+        markTileFailed(tileLoader, coord, "No tile source.", false);
+        return;
+    }
+
+    // Sources on the local filesystem are read right here, on this I/O thread.
+    if (!tileSource->isCacheable()) {
+        startFetch(tileLoader, *tileSource, coord);
+        return;
+    }
+
+    // Tiles that have been decoded before skip straight to the GPU upload.
+    if (loadDecodedTileFromCache(tileLoader, coord)) {
+        // Only the raw tile knows when it goes stale. If it has been evicted,
+        // there's nothing to revalidate against, and asking the source for the
+        // whole tile on every load would defeat the decoded cache. The decoded
+        // tile is used until it's evicted too, then the tile is fetched again.
+        auto metadataOpt = tileLoader.m_diskCache->readMetadata(coord);
+        if (metadataOpt.has_value()) {
+            revalidateIfStale(tileLoader, *tileSource, coord, metadataOpt.value());
+        }
+        return;
+    }
+
+    auto cachedOpt = tileLoader.m_diskCache->read(coord);
+    if (!cachedOpt.has_value()) {
+        // Not in the cache. Fetch it from the source.
+        startFetch(tileLoader, *tileSource, coord);
+        return;
+    }
+    auto& cached = cachedOpt.value();
+
+    // Check if we have previously been told this tile doesn't exist.
+    if (cached.kind == TileDiskCache::EntryKind::Missing) {
+        auto age = QDateTime::currentSecsSinceEpoch() - cached.writtenAtSecs;
+        if (age < missingTileDiskCacheLifetimeSecs) {
+            markTileFailed(tileLoader, coord, "Tile is known to be missing.", true);
+            return;
+        }
+        // The entry is stale, ask the tile source again.
+        tileLoader.m_diskCache->remove(coord);
+        startFetch(tileLoader, *tileSource, coord);
+        return;
+    }
+
+    revalidateIfStale(tileLoader, *tileSource, coord, cached.metadata);
+
+    // The bytes point straight into the mapped segment file, so the decoder
+    // parses out of the page cache without copying the tile first. The job
+    // holds on to keepAlive until the bytes have been decoded.
+    //
+    // Decoding goes into the CPU queue, so that more urgent
+    // tiles can get ahead of this one.
+    auto tileBytes = cached.bytes;
+    scheduleJob(tileLoader, JobKind::Cpu, coord, [=, &tileLoader, keepAlive = cached.keepAlive]() {
+        TileLoaderImpl::processTile(
+            tileLoader,
+            coord,
+            tileBytes,
+            true);
+    });
+}
+
+void TileLoaderImpl::revalidateIfStale(
+    TileLoader& tileLoader,
+    TileSource& tileSource,
+    TileCoord coord,
+    QByteArray const& cacheMetadata)
+{
+    // Tiles cached before validators were stored count as stale,
+    // and are fetched again without any.
+    auto validators = parseTileValidators(cacheMetadata).value_or(TileValidators{});
+    if (validators.expiresAtSecs > QDateTime::currentSecsSinceEpoch()) {
+        return;
+    }
+
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._activeRevalidationsLock };
+        if (!tileLoader.m_activeRevalidations.insert(coord).second) {
+            return;
+        }
+    }
+
+    tileSource.revalidateTile(
+        coord,
+        validators,
+        [=, &tileLoader](TileFetchResult result) {
+            handleRevalidationResult(tileLoader, coord, validators, std::move(result));
+        });
+}
+
+void TileLoaderImpl::handleRevalidationResult(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    TileValidators const& oldValidators,
+    TileFetchResult result)
+{
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._activeRevalidationsLock };
+        tileLoader.m_activeRevalidations.erase(coord);
+    }
+
+    auto diskCache = tileLoader.m_diskCache;
+    switch (result.status) {
+    case TileFetchResult::Status::NotModified: {
+        // Servers can leave out the validators that haven't changed.
+        auto validators = result.validators;
+        if (validators.etag.isEmpty()) {
+            validators.etag = oldValidators.etag;
+        }
+        if (validators.lastModified.isEmpty()) {
+            validators.lastModified = oldValidators.lastModified;
+        }
+        // Only the expiry changes, the tile itself stays where it is.
+        updateDiskCacheMetadata(tileLoader, diskCache, coord, serializeTileValidators(validators));
+        break;
+    }
+    case TileFetchResult::Status::Success:
+        writeToDiskCache(
+            tileLoader,
+            diskCache,
+            coord,
+            TileDiskCache::EntryKind::Tile,
+            result.bytes,
+            serializeTileValidators(result.validators));
+        // The decoded tile is out of date, it gets decoded again on the next load.
+        writeToDiskCache(tileLoader, tileLoader.m_decodedTileCache, coord, TileDiskCache::EntryKind::Removed, {});
+        break;
+    case TileFetchResult::Status::NotFound:
+        writeToDiskCache(tileLoader, diskCache, coord, TileDiskCache::EntryKind::Missing, {});
+        writeToDiskCache(tileLoader, tileLoader.m_decodedTileCache, coord, TileDiskCache::EntryKind::Removed, {});
+        break;
+    case TileFetchResult::Status::Error:
+        // Keep using the stale tile, the next load tries again.
+        break;
+    }
+}
+
+void TileLoaderImpl::loadTilesFromSource(TileLoader& tileLoader, std::vector<TileCoord> coords)
+{
+    // Don't bother fetching tiles that are already out of view.
+    coords.erase(
+        std::remove_if(
+            coords.begin(),
+            coords.end(),
+            [&](TileCoord coord) { return cancelIfObsolete(tileLoader, coord); }),
+        coords.end());
+    if (coords.empty()) {
+        return;
+    }
+
+    // Most urgent first, the focus might have moved while this job was waiting.
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._pendingJobsLock };
+        std::sort(
+            coords.begin(),
+            coords.end(),
+            [&](TileCoord a, TileCoord b) {
+                return calcJobPriority(tileLoader, a) < calcJobPriority(tileLoader, b);
+            });
+    }
+
+    auto fetchIds = std::make_shared<std::map<TileCoord, quint64>>();
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._activeFetchesLock };
+        for (auto const& coord : coords) {
+            auto fetchId = tileLoader.m_nextFetchId++;
+            tileLoader.m_activeFetches[coord] = fetchId;
+            fetchIds->insert({ coord, fetchId });
+        }
+    }
+
+    tileLoader.m_tileSource.load()->fetchTiles(
+        coords,
+        [&tileLoader, fetchIds](TileCoord coord, TileFetchResult result) {
+            auto it = fetchIds->find(coord);
+            if (it != fetchIds->end()) {
+                handleFetchResult(tileLoader, coord, it->second, std::move(result));
+            }
+        });
+}
+
+double TileLoaderImpl::calcJobPriority(TileLoader const& tileLoader, TileCoord coord)
+{
+    // Tiles at the zoom level currently being displayed always go first.
+    // Within a zoom level, tiles closest to the viewport center go first.
+    // Anything not visible right now was prefetched, and goes after all of that.
+    auto const& focus = tileLoader.m_jobFocus;
+    int zoomDiff = std::abs(coord.level - focus.zoom);
+    bool isVisible =
+        zoomDiff == 0 &&
+        coord.x >= focus.minTileX && coord.x <= focus.maxTileX &&
+        coord.y >= focus.minTileY && coord.y <= focus.maxTileY;
+
+    // Measure the distance in world-normalized coordinates, then
+    // scale it so that 1 unit equals one tile at the focus zoom level.
+    double tileSize = 1.0 / (1 << coord.level);
+    double tileCenterX = (coord.x + 0.5) * tileSize;
+    double tileCenterY = (coord.y + 0.5) * tileSize;
+    double distance = std::hypot(tileCenterX - focus.x, tileCenterY - focus.y);
+    distance *= (1 << focus.zoom);
+
+    // No viewport spans a million tiles, so the zoom difference always dominates.
+    return (isVisible ? 0.0 : 100'000'000.0) + zoomDiff * 1'000'000.0 + distance;
+}
+
+void TileLoaderImpl::scheduleJob(
+    TileLoader& tileLoader,
+    JobKind kind,
+    TileCoord coord,
+    std::function<void()>&& fn)
+{
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._pendingJobsLock };
+        if (tileLoader.m_jobsStopped) {
+            return;
+        }
+        auto& jobs = kind == JobKind::Io ? tileLoader.m_pendingIoJobs : tileLoader.m_pendingCpuJobs;
+        jobs.push_back({ coord, std::move(fn) });
+    }
+
+    // Every job submitted to the thread pool runs whichever pending job is the most
+    // urgent at the time a thread becomes free. So there's always exactly as many
+    // thread pool tasks as there are pending jobs of that kind.
+    auto& threadPool = kind == JobKind::Io ? tileLoader.m_ioThreadPool : tileLoader.m_cpuThreadPool;
+    threadPool.start([&tileLoader, kind]() {
+        runMostUrgentJob(tileLoader, kind);
+    });
+}
+
+void TileLoaderImpl::writeToDiskCache(
+    TileLoader& tileLoader,
+    std::shared_ptr<TileDiskCache> const& diskCache,
+    TileCoord coord,
+    TileDiskCache::EntryKind kind,
+    QByteArray const& bytes,
+    QByteArray const& metadata)
+{
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._pendingCacheWritesLock };
+        auto& pendingWrite = tileLoader.m_pendingCacheWrites[{ diskCache.get(), coord.toPackedKey() }];
+        pendingWrite.diskCache = diskCache;
+        pendingWrite.coord = coord;
+        pendingWrite.kind = quint8(kind);
+        pendingWrite.bytes = bytes;
+        pendingWrite.metadata = metadata;
+        pendingWrite.metadataOnly = false;
+
+        if (tileLoader.m_cacheWriteBackScheduled) {
+            return;
+        }
+        tileLoader.m_cacheWriteBackScheduled = true;
+    }
+
+    tileLoader.m_writeBackThreadPool.start([&tileLoader]() {
+        runCacheWriteBack(tileLoader);
+    });
+}
+
+void TileLoaderImpl::updateDiskCacheMetadata(
+    TileLoader& tileLoader,
+    std::shared_ptr<TileDiskCache> const& diskCache,
+    TileCoord coord,
+    QByteArray const& metadata)
+{
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._pendingCacheWritesLock };
+        auto [it, inserted] = tileLoader.m_pendingCacheWrites.try_emplace({ diskCache.get(), coord.toPackedKey() });
+        auto& pendingWrite = it->second;
+        if (inserted) {
+            pendingWrite.diskCache = diskCache;
+            pendingWrite.coord = coord;
+            pendingWrite.metadataOnly = true;
+        } else if (!pendingWrite.metadataOnly && TileDiskCache::EntryKind(pendingWrite.kind) != TileDiskCache::EntryKind::Tile) {
+            // The tile is on its way out of the cache, there's nothing left to update.
+            return;
+        }
+        // A tile that is still waiting to be written takes the new metadata along.
+        pendingWrite.metadata = metadata;
+
+        if (tileLoader.m_cacheWriteBackScheduled) {
+            return;
+        }
+        tileLoader.m_cacheWriteBackScheduled = true;
+    }
+
+    tileLoader.m_writeBackThreadPool.start([&tileLoader]() {
+        runCacheWriteBack(tileLoader);
+    });
+}
+
+void TileLoaderImpl::runCacheWriteBack(TileLoader& tileLoader)
+{
+    while (true) {
+        // Take everything that has queued up since last round,
+        // so new writes can keep coming in while we're busy.
+        std::map<std::pair<TileDiskCache*, quint64>, PendingCacheWrite> pendingWrites;
+        {
+            auto autoLock = std::lock_guard{ *tileLoader._pendingCacheWritesLock };
+            if (tileLoader.m_pendingCacheWrites.empty()) {
+                tileLoader.m_cacheWriteBackScheduled = false;
+                return;
+            }
+            std::swap(pendingWrites, tileLoader.m_pendingCacheWrites);
+        }
+
+        // The map is ordered by cache, so each cache gets one batch.
+        auto it = pendingWrites.begin();
+        while (it != pendingWrites.end()) {
+            auto diskCache = it->second.diskCache;
+            std::vector<TileDiskCache::WriteItem> items;
+            std::vector<std::pair<TileCoord, QByteArray>> metadataUpdates;
+            for (; it != pendingWrites.end() && it->second.diskCache == diskCache; it++) {
+                auto& pendingWrite = it->second;
+                if (pendingWrite.metadataOnly) {
+                    metadataUpdates.push_back({ pendingWrite.coord, std::move(pendingWrite.metadata) });
+                    continue;
+                }
+                items.push_back({
+                    pendingWrite.coord,
+                    TileDiskCache::EntryKind(pendingWrite.kind),
+                    std::move(pendingWrite.bytes),
+                    std::move(pendingWrite.metadata) });
+            }
+            if (!items.empty() && !diskCache->writeBatch(items)) {
+                qWarning() << "Unable to write tiles to the disk cache.";
+            }
+            // Each tile has at most one pending write per round,
+            // so these never race with the batch above.
+            for (auto const& [coord, metadata] : metadataUpdates) {
+                diskCache->updateMetadata(coord, metadata);
+            }
+
+            // Every now and then, trim the cache and clean out
+            // the garbage left by overwritten tiles.
+            tileLoader.m_diskCacheWritesSinceMaintenance += int(items.size());
+            if (tileLoader.m_diskCacheWritesSinceMaintenance >= diskCacheWritesBetweenMaintenance) {
+                tileLoader.m_diskCacheWritesSinceMaintenance = 0;
+                scheduleDiskCacheMaintenance(tileLoader);
+            }
+        }
+    }
+}
+
+void TileLoaderImpl::attachTileSource(TileLoader& tileLoader, TileSource* tileSource, bool attach)
+{
+    if (tileSource == nullptr) {
+        return;
+    }
+    if (!attach) {
+        tileSource->setFetchPriorityFunction(nullptr);
+        tileSource->setFetchProgressFunction(nullptr);
+        return;
+    }
+    tileSource->setFetchPriorityFunction([&tileLoader](TileCoord coord) {
+        auto autoLock = std::lock_guard{ *tileLoader._pendingJobsLock };
+        return calcJobPriority(tileLoader, coord);
+    });
+    tileSource->setFetchProgressFunction(
+        [&tileLoader](TileCoord coord, QByteArray const& bytesSoFar, qint64 expectedSize) {
+            handleFetchProgress(tileLoader, coord, bytesSoFar, expectedSize);
+        });
+}
+
+void TileLoaderImpl::scheduleDiskCacheOpen(TileLoader& tileLoader)
+{
+    auto diskCache = tileLoader.m_diskCache;
+    auto decodedTileCache = tileLoader.m_decodedTileCache;
+    if (diskCache == nullptr) {
+        return;
+    }
+    auto cacheName = tileLoader.m_tileSource.load()->getCacheName();
+    tileLoader.m_maintenanceThreadPool.start([=]() {
+        diskCache->openAll();
+        decodedTileCache->openAll();
+        removeStaleDecodedTileCaches(cacheName);
+    });
+}
+
+void TileLoaderImpl::scheduleDiskCacheMaintenance(TileLoader& tileLoader)
+{
+    auto diskCache = tileLoader.m_diskCache;
+    auto decodedTileCache = tileLoader.m_decodedTileCache;
+    if (diskCache == nullptr) {
+        return;
+    }
+    tileLoader.m_maintenanceThreadPool.start([=]() {
+        diskCache->trainCompressionDictionary();
+        for (auto const& cache : { diskCache, decodedTileCache }) {
+            cache->evictOverBudget();
+            cache->compact();
+        }
+    });
+}
+
+void TileLoaderImpl::dropPendingJobs(TileLoader& tileLoader)
+{
+    // Every thread pool task runs exactly one pending job, so the jobs can't
+    // just be removed. They're replaced with ones that do nothing instead.
+    auto autoLock = std::lock_guard{ *tileLoader._pendingJobsLock };
+    tileLoader.m_jobsStopped = true;
+    for (auto* jobs : { &tileLoader.m_pendingIoJobs, &tileLoader.m_pendingCpuJobs }) {
+        for (auto& job : *jobs) {
+            job.fn = []() {};
+        }
+    }
+}
+
+void TileLoaderImpl::runMostUrgentJob(TileLoader& tileLoader, JobKind kind)
+{
+    std::function<void()> fn;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._pendingJobsLock };
+        auto& jobs = kind == JobKind::Io ? tileLoader.m_pendingIoJobs : tileLoader.m_pendingCpuJobs;
+        if (jobs.empty()) {
+            qFatal("Developer error. Ran out of pending tile jobs.");
+        }
+
+        // A linear scan is fine here, the queue rarely holds more than a
+        // few hundred jobs. And it means we don't have to re-sort anything
+        // when the focus changes.
+        auto mostUrgentIt = std::min_element(
+            jobs.begin(),
+            jobs.end(),
+            [&](auto const& a, auto const& b) {
+                return calcJobPriority(tileLoader, a.coord) < calcJobPriority(tileLoader, b.coord);
+            });
+
+        fn = std::move(mostUrgentIt->fn);
+        *mostUrgentIt = std::move(jobs.back());
+        jobs.pop_back();
+    }
+
+    fn();
+}
+
+void TileLoaderImpl::updateJobFocus(TileLoader& tileLoader, QSpan<TileCoord const> visibleTiles)
+{
+    if (visibleTiles.empty()) {
+        return;
+    }
+
+    // The zoom level being displayed is the highest in the set,
+    // and the center is the average of the tiles at that level.
+    JobFocus newFocus = {};
+    newFocus.x = 0;
+    newFocus.y = 0;
+    for (auto const& coord : visibleTiles) {
+        newFocus.zoom = std::max(newFocus.zoom, coord.level);
+    }
+    newFocus.minTileX = std::numeric_limits<int>::max();
+    newFocus.minTileY = std::numeric_limits<int>::max();
+    newFocus.maxTileX = std::numeric_limits<int>::min();
+    newFocus.maxTileY = std::numeric_limits<int>::min();
+    int count = 0;
+    for (auto const& coord : visibleTiles) {
+        if (coord.level != newFocus.zoom) {
+            continue;
+        }
+        double tileSize = 1.0 / (1 << coord.level);
+        newFocus.x += (coord.x + 0.5) * tileSize;
+        newFocus.y += (coord.y + 0.5) * tileSize;
+        newFocus.minTileX = std::min(newFocus.minTileX, coord.x);
+        newFocus.minTileY = std::min(newFocus.minTileY, coord.y);
+        newFocus.maxTileX = std::max(newFocus.maxTileX, coord.x);
+        newFocus.maxTileY = std::max(newFocus.maxTileY, coord.y);
+        count++;
+    }
+    newFocus.x /= count;
+    newFocus.y /= count;
+
+    auto autoLock = std::lock_guard{ *tileLoader._pendingJobsLock };
+    tileLoader.m_jobFocus = newFocus;
+}
+
+void TileLoaderImpl::handleFetchResult(
     TileLoader& tileLoader,
     TileCoord tileCoord,
-    QNetworkReply* reply)
+    quint64 fetchId,
+    TileFetchResult result)
 {
-    // This will be called on the thread belonging to the QNetworkAccessManager.
+    // This can be called on any thread, depending on the TileSource.
     //
-    // We just want to do error checking, then extract the information we want
-    // and then offload the rest of the processing to another thread.
-    reply->deleteLater();
+    // We just want to do error checking, then offload
+    // the rest of the processing to another thread.
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._activeFetchesLock };
+        auto it = tileLoader.m_activeFetches.find(tileCoord);
+        if (it == tileLoader.m_activeFetches.end() || it->second != fetchId) {
+            // This fetch was cancelled by abortObsoleteFetches, which has already
+            // removed the tile. The tile might have been requested again since,
+            // in which case the newer fetch is the one we're waiting for.
+            return;
+        }
+        tileLoader.m_activeFetches.erase(it);
+    }
 
-    if (!reply->isFinished()) {
-        qFatal("Developer error");
+    // If the tile was big, decoding might already be underway.
+    std::shared_ptr<StreamingDecode> streamingDecode;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._streamingDecodesLock };
+        auto it = tileLoader.m_streamingDecodes.find(tileCoord);
+        if (it != tileLoader.m_streamingDecodes.end()) {
+            streamingDecode = std::move(it->second);
+            tileLoader.m_streamingDecodes.erase(it);
+        }
     }
 
-    if (reply->error() != QNetworkReply::NoError) {
+    bool cacheable = tileLoader.m_diskCache != nullptr;
 
-        QVariant contentType = reply->header(QNetworkRequest::ContentTypeHeader);
-        if (contentType == "text/plain;charset=UTF-8") {
-            QByteArray byteArray = reply->readAll();
-            auto errorString = QString::fromUtf8(byteArray);
+    if (result.status == TileFetchResult::Status::NotFound) {
+        markTileFailed(tileLoader, tileCoord, result.errorString, true);
+        if (cacheable) {
+            writeToDiskCache(tileLoader, tileLoader.m_diskCache, tileCoord, TileDiskCache::EntryKind::Missing, {});
         }
+        return;
+    }
 
-        qFatal("Unimplemented");
+    if (result.status != TileFetchResult::Status::Success) {
+        markTileFailed(tileLoader, tileCoord, result.errorString, false);
+        return;
     }
 
-    QVariant contentType = reply->header(QNetworkRequest::ContentTypeHeader);
-    if (contentType != "application/x-protobuf") {
-        // Error handling, we got back an unexpected reply.
-        qFatal("Unimplemented");
+    // We've paid for the fetch, so it goes into the disk cache right away,
+    // even if the tile is no longer needed. Along with it go the validators,
+    // so we can tell when it goes stale and ask the source about it.
+    if (cacheable) {
+        writeToDiskCache(
+            tileLoader,
+            tileLoader.m_diskCache,
+            tileCoord,
+            TileDiskCache::EntryKind::Tile,
+            result.bytes,
+            serializeTileValidators(result.validators));
     }
 
-    QByteArray byteArray = reply->readAll();
+    if (cancelIfObsolete(tileLoader, tileCoord)) {
+        return;
+    }
 
-    tileLoader.m_threadPool.start([=, &tileLoader]() {
+    if (streamingDecode != nullptr &&
+        completeStreamingDecode(tileLoader, tileCoord, streamingDecode, result.bytes))
+    {
+        return;
+    }
+
+    scheduleJob(tileLoader, JobKind::Cpu, tileCoord, [=, &tileLoader, bytes = std::move(result.bytes)]() {
         // QByteArray has COW semantics, so we can just capture by value here...
         processTile(
             tileLoader,
             tileCoord,
-            byteArray,
-            true);
+            bytes,
+            false);
     });
 }
 
@@ -408,26 +2304,257 @@ void TileLoaderImpl::processTile(
     TileLoader& tileLoader,
     TileCoord tileCoord,
     QByteArray tileBytes,
-    bool writeToFile)
+    bool fromDiskCache)
 {
+    // Last chance to skip the expensive decoding and triangulation.
+    if (cancelIfObsolete(tileLoader, tileCoord)) {
+        return;
+    }
+
     auto decodedTileOpt = TileLoaderImpl::decodeTileLayers(tileLoader, tileBytes);
     if (!decodedTileOpt.has_value()) {
-        qFatal("");
+        // The entry in the disk cache is corrupt. Remove it so that the retry
+        // fetches it from the tile source instead. A tile that was just fetched
+        // is still waiting to be written, so the removal has to queue up behind it.
+        if (tileLoader.m_diskCache != nullptr) {
+            if (fromDiskCache) {
+                tileLoader.m_diskCache->remove(tileCoord);
+            } else {
+                writeToDiskCache(tileLoader, tileLoader.m_diskCache, tileCoord, TileDiskCache::EntryKind::Removed, {});
+            }
+        }
+        markTileFailed(tileLoader, tileCoord, "Unable to decode tile.", false);
+        return;
+    }
+
+    finishDecodedTile(tileLoader, tileCoord, std::move(decodedTileOpt.value()));
+}
+
+void TileLoaderImpl::finishDecodedTile(
+    TileLoader& tileLoader,
+    TileCoord tileCoord,
+    DecodedTile&& decodedTile)
+{
+    // Store the result of all that work, so it doesn't have to be done again.
+    if (tileLoader.m_decodedTileCache != nullptr) {
+        writeToDiskCache(
+            tileLoader,
+            tileLoader.m_decodedTileCache,
+            tileCoord,
+            TileDiskCache::EntryKind::Tile,
+            serializeDecodedTile(decodedTile));
+    }
+
+    setTileReadyForUpload(tileLoader, tileCoord, std::move(decodedTile));
+}
+
+void TileLoaderImpl::handleFetchProgress(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    QByteArray const& bytesSoFar,
+    qint64 expectedSize)
+{
+    if (std::max<qint64>(expectedSize, bytesSoFar.size()) < streamingDecodeMinBytes) {
+        return;
+    }
+
+    // Holding on to the active fetches lock means the fetch can't be
+    // aborted while we set up its entry.
+    auto activeFetchesLock = std::lock_guard{ *tileLoader._activeFetchesLock };
+    if (tileLoader.m_activeFetches.count(coord) == 0) {
+        return;
+    }
+    auto autoLock = std::lock_guard{ *tileLoader._streamingDecodesLock };
+    auto& streamingDecode = tileLoader.m_streamingDecodes[coord];
+    if (streamingDecode == nullptr) {
+        streamingDecode = std::make_shared<StreamingDecode>();
+    }
+    if (streamingDecode->failed) {
+        return;
+    }
+    if (!scheduleStreamedLayers(tileLoader, coord, streamingDecode, bytesSoFar)) {
+        streamingDecode->failed = true;
+    }
+}
+
+bool TileLoaderImpl::scheduleStreamedLayers(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    std::shared_ptr<StreamingDecode> const& streamingDecode,
+    QByteArray const& bytes)
+{
+    std::vector<std::pair<qsizetype, qsizetype>> newLayers;
+    if (!findCompleteTileLayers(bytes, streamingDecode->scannedBytes, newLayers)) {
+        return false;
+    }
+
+    for (auto const& [layerOffset, layerLength] : newLayers) {
+        auto layerIndex = streamingDecode->layers.size();
+        streamingDecode->layers.emplace_back();
+        streamingDecode->layersInProgress++;
+        // The source keeps appending to its buffer,
+        // so the layer gets a copy of its own.
+        auto layerBytes = bytes.mid(layerOffset, layerLength);
+        scheduleJob(tileLoader, JobKind::Cpu, coord, [=, &tileLoader]() {
+            decodeStreamedLayer(tileLoader, coord, streamingDecode, layerIndex, layerBytes);
+        });
+    }
+    return true;
+}
+
+void TileLoaderImpl::decodeStreamedLayer(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    std::shared_ptr<StreamingDecode> const& streamingDecode,
+    size_t layerIndex,
+    QByteArray layerBytes)
+{
+    bool skip = false;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._streamingDecodesLock };
+        skip = streamingDecode->failed;
+    }
+    // Layers of a tile that has gone out of view aren't worth decoding. Giving up
+    // on streaming hands the tile back to the regular path, which drops it once
+    // it sees that it's obsolete, the same as any other tile.
+    skip = skip || isObsolete(tileLoader, coord);
+
+    std::optional<DecodedTile> decodedLayerOpt;
+    if (!skip) {
+        auto protobufArena = TileLoaderImpl::getProtobufArena(tileLoader);
+        auto arenaCleanup = QScopeGuard{ [&]() {
+            protobufArena->Reset();
+        }};
+        auto layer = google::protobuf::Arena::CreateMessage<vector_tile::Tile_Layer>(protobufArena);
+        if (layer->ParseFromArray(layerBytes.data(), layerBytes.size())) {
+            DecodedTile decodedLayer;
+            if (decodeLayer(*layer, decodedLayer)) {
+                decodedLayerOpt = std::move(decodedLayer);
+            }
+        }
+    }
+
+    bool isLastLayer = false;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._streamingDecodesLock };
+        streamingDecode->layersInProgress--;
+        if (decodedLayerOpt.has_value()) {
+            streamingDecode->layers[layerIndex] = std::move(decodedLayerOpt);
+        } else {
+            streamingDecode->failed = true;
+        }
+        isLastLayer =
+            streamingDecode->isComplete &&
+            streamingDecode->layersInProgress == 0;
+    }
+
+    if (isLastLayer) {
+        finishStreamingDecode(tileLoader, coord, streamingDecode);
+    }
+}
+
+bool TileLoaderImpl::completeStreamingDecode(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    std::shared_ptr<StreamingDecode> const& streamingDecode,
+    QByteArray const& tileBytes)
+{
+    auto autoLock = std::lock_guard{ *tileLoader._streamingDecodesLock };
+    if (streamingDecode->failed) {
+        return false;
+    }
+
+    // The last layers might have come in with the final chunk.
+    bool success =
+        scheduleStreamedLayers(tileLoader, coord, streamingDecode, tileBytes) &&
+        streamingDecode->scannedBytes == tileBytes.size();
+    if (!success) {
+        // The jobs still running will find this and drop their results.
+        streamingDecode->failed = true;
+        return false;
+    }
+
+    streamingDecode->isComplete = true;
+    streamingDecode->tileBytes = tileBytes;
+    if (streamingDecode->layersInProgress == 0) {
+        // We're on the tile source's thread, so the rest happens elsewhere.
+        scheduleJob(tileLoader, JobKind::Cpu, coord, [=, &tileLoader]() {
+            finishStreamingDecode(tileLoader, coord, streamingDecode);
+        });
     }
-    auto& decodedTile = decodedTileOpt.value();
+    return true;
+}
 
+void TileLoaderImpl::finishStreamingDecode(
+    TileLoader& tileLoader,
+    TileCoord coord,
+    std::shared_ptr<StreamingDecode> const& streamingDecode)
+{
+    std::vector<std::optional<DecodedTile>> decodedLayers;
+    QByteArray tileBytes;
+    bool failed = false;
+    {
+        auto autoLock = std::lock_guard{ *tileLoader._streamingDecodesLock };
+        decodedLayers = std::move(streamingDecode->layers);
+        tileBytes = streamingDecode->tileBytes;
+        failed = streamingDecode->failed;
+    }
+
+    // A layer failed after the whole tile came in. Decoding the whole
+    // tile will fail too, but it takes care of reporting it properly.
+    if (failed) {
+        processTile(tileLoader, coord, tileBytes, false);
+        return;
+    }
+
+    if (cancelIfObsolete(tileLoader, coord)) {
+        return;
+    }
+
+    // Every layer was decoded with its own buffers starting at zero,
+    // so the offsets of the features have to be moved along.
+    DecodedTile decodedTile;
+    for (auto& decodedLayer : decodedLayers) {
+        auto vtxByteBase = qint64(decodedTile.vertices.size() * sizeof(decodedTile.vertices[0]));
+        auto idxByteBase = qint64(decodedTile.indices.size() * sizeof(decodedTile.indices[0]));
+        for (auto& layer : decodedLayer->layers) {
+            for (auto& feature : layer.features) {
+                feature.vtxByteOffset += vtxByteBase;
+                feature.idxByteOffset += idxByteBase;
+            }
+            decodedTile.layers.push_back(std::move(layer));
+        }
+        decodedTile.vertices.insert(
+            decodedTile.vertices.end(),
+            decodedLayer->vertices.begin(),
+            decodedLayer->vertices.end());
+        decodedTile.indices.insert(
+            decodedTile.indices.end(),
+            decodedLayer->indices.begin(),
+            decodedLayer->indices.end());
+    }
+
+    finishDecodedTile(tileLoader, coord, std::move(decodedTile));
+}
+
+void TileLoaderImpl::setTileReadyForUpload(
+    TileLoader& tileLoader,
+    TileCoord tileCoord,
+    DecodedTile&& decodedTile)
+{
     // We've decoded the tile but we can't upload it to the GPU until later
     // when we have access to QRhi.
     // Push onto a list of pending
 
     {
-        // Append this job to our list of pending GPU uploads.
-        auto autoLock = std::lock_guard{ *tileLoader._tileMemoryLock };
+        auto packedKey = tileCoord.toPackedKey();
+        auto& shard = getShard(tileLoader, packedKey);
+        auto autoLock = std::lock_guard{ shard.lock };
         // Find the tile-element we're processing
         // We assume this element already exists, and is in the pending state.
         // If it's not, we fucked up big time.
-        auto tileIt = tileLoader.tileStorage.find(tileCoord);
-        if (tileIt == tileLoader.tileStorage.end()) {
+        auto tileIt = shard.tiles.find(packedKey);
+        if (tileIt == shard.tiles.end()) {
             qFatal(
                 "Tried to set a tile for being ready for GPU transfers, "
                 "but couldn't find existing tile-node.");
@@ -441,29 +2568,124 @@ void TileLoaderImpl::processTile(
         }
 
         tile.state = TileProgressState::ReadyForGpuUpload;
+        if (tile.isPrefetch) {
+            tileLoader.prefetchTilesInFlight--;
+        }
 
         tile.verticesForUpload = std::move(decodedTile.vertices);
         tile.indicesForUpload = std::move(decodedTile.indices);
         tile.layersForGpuUpload = std::move(decodedTile.layers);
 
-        // Now we can signal that this tile is ready
-        emit tileLoader.tileLoaded(true, tileCoord);
+        // Append this job to our list of pending GPU uploads.
+        {
+            auto uploadLock = std::lock_guard{ *tileLoader._readyForUploadLock };
+            tileLoader.tilesReadyForUpload.push_back(tileCoord);
+        }
     }
 
-    if (writeToFile) {
-        // Then we write to the disk cache.
-        QString basePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    // Now we can signal that this tile is ready
+    queueTileNotification(tileLoader, tileCoord, true);
+}
 
-        auto dir = QDir::cleanPath(
-            basePath + QDir::separator() +
-            "tiles" + QDir::separator() +
-            "maptiler_planet" + QDir::separator() +
-            tileCoordToFilename(tileCoord));
-        bool fileWriteSuccess = writeNewFileHelper(dir, tileBytes);
-        if (!fileWriteSuccess) {
-            qFatal("Unable to write to file.");
+QByteArray TileLoaderImpl::serializeDecodedTile(DecodedTile const& decodedTile)
+{
+    DecodedTileHeader header = {};
+    std::memcpy(header.magic, decodedTileMagic, sizeof(header.magic));
+    header.decoderVersion = tileDecoderVersion;
+    header.vertexCount = quint32(decodedTile.vertices.size());
+    header.indexCount = quint32(decodedTile.indices.size());
+
+    auto verticesSize = qsizetype(decodedTile.vertices.size() * sizeof(decodedTile.vertices[0]));
+    auto indicesSize = qsizetype(decodedTile.indices.size() * sizeof(decodedTile.indices[0]));
+
+    QByteArray bytes;
+    bytes.reserve(qsizetype(sizeof(header)) + verticesSize + indicesSize);
+    bytes.append(reinterpret_cast<char const*>(&header), sizeof(header));
+    bytes.append(reinterpret_cast<char const*>(decodedTile.vertices.data()), verticesSize);
+    bytes.append(reinterpret_cast<char const*>(decodedTile.indices.data()), indicesSize);
+
+    QDataStream stream { &bytes, QIODevice::WriteOnly | QIODevice::Append };
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << quint32(decodedTile.layers.size());
+    for (auto const& layer : decodedTile.layers) {
+        stream << layer.name << quint32(layer.features.size());
+        for (auto const& feature : layer.features) {
+            stream << feature.vtxByteOffset << feature.idxByteOffset << feature.idxCount;
+            stream << quint32(feature.metaData.size());
+            for (auto const& [key, value] : feature.metaData) {
+                stream << key << value;
+            }
         }
     }
+    return bytes;
+}
+
+std::optional<TileLoaderImpl::DecodedTile> TileLoaderImpl::parseDecodedTile(QByteArray const& bytes)
+{
+    DecodedTileHeader header = {};
+    if (bytes.size() < qsizetype(sizeof(header))) {
+        return std::nullopt;
+    }
+    std::memcpy(&header, bytes.constData(), sizeof(header));
+    if (std::memcmp(header.magic, decodedTileMagic, sizeof(header.magic)) != 0 ||
+        header.decoderVersion != tileDecoderVersion)
+    {
+        return std::nullopt;
+    }
+
+    DecodedTile decodedTile;
+    auto verticesSize = qsizetype(header.vertexCount) * qsizetype(sizeof(decodedTile.vertices[0]));
+    auto indicesSize = qsizetype(header.indexCount) * qsizetype(sizeof(decodedTile.indices[0]));
+    qsizetype offset = sizeof(header);
+    if (bytes.size() - offset < verticesSize + indicesSize) {
+        return std::nullopt;
+    }
+
+    decodedTile.vertices.resize(header.vertexCount);
+    std::memcpy(decodedTile.vertices.data(), bytes.constData() + offset, verticesSize);
+    offset += verticesSize;
+    decodedTile.indices.resize(header.indexCount);
+    std::memcpy(decodedTile.indices.data(), bytes.constData() + offset, indicesSize);
+    offset += indicesSize;
+
+    auto layerBytes = QByteArray::fromRawData(bytes.constData() + offset, bytes.size() - offset);
+    QDataStream stream { layerBytes };
+    stream.setVersion(QDataStream::Qt_6_0);
+
+    quint32 layerCount = 0;
+    stream >> layerCount;
+    for (quint32 layerIndex = 0; layerIndex < layerCount && stream.status() == QDataStream::Ok; layerIndex++) {
+        TilePendingLayer layer;
+        quint32 featureCount = 0;
+        stream >> layer.name >> featureCount;
+        for (quint32 featureIndex = 0; featureIndex < featureCount && stream.status() == QDataStream::Ok; featureIndex++) {
+            TilePendingFeature feature;
+            quint32 metaDataCount = 0;
+            stream >> feature.vtxByteOffset >> feature.idxByteOffset >> feature.idxCount >> metaDataCount;
+            for (quint32 i = 0; i < metaDataCount && stream.status() == QDataStream::Ok; i++) {
+                QString key;
+                QVariant value;
+                stream >> key >> value;
+                feature.metaData.insert({ key, value });
+            }
+
+            // Never let a feature draw outside the buffers of its tile.
+            bool inBounds =
+                feature.vtxByteOffset >= 0 && feature.vtxByteOffset <= verticesSize &&
+                feature.idxByteOffset >= 0 && feature.idxCount >= 0 &&
+                feature.idxByteOffset + feature.idxCount * qint64(sizeof(qint32)) <= indicesSize;
+            if (!inBounds) {
+                return std::nullopt;
+            }
+            layer.features.push_back(std::move(feature));
+        }
+        decodedTile.layers.push_back(std::move(layer));
+    }
+    if (stream.status() != QDataStream::Ok) {
+        return std::nullopt;
+    }
+
+    return decodedTile;
 }
 
 std::optional<TileLoaderImpl::DecodedTile> TileLoaderImpl::decodeTileLayers(
@@ -477,86 +2699,99 @@ std::optional<TileLoaderImpl::DecodedTile> TileLoaderImpl::decodeTileLayers(
     auto tile = google::protobuf::Arena::CreateMessage<vector_tile::Tile>(protobufArena);
 
     if (!tile->ParseFromArray(bytes.data(), bytes.size())) {
-        qFatal("Tile parsing error.");
+        return std::nullopt;
     }
 
     // Decode the layers into our own internal data-type
 
     DecodedTile decodedTile;
     for (auto const& inLayer : tile->layers()) {
+        if (!decodeLayer(inLayer, decodedTile)) {
+            return std::nullopt;
+        }
+    }
 
-        TilePendingLayer outLayer = {};
-        outLayer.name = QString::fromStdString(inLayer.name());
+    return decodedTile;
+}
 
-        auto const& layerKeys = inLayer.keys();
-        auto const& layerValues = inLayer.values();
+bool TileLoaderImpl::decodeLayer(
+    vector_tile::Tile_Layer const& inLayer,
+    DecodedTile& decodedTile)
+{
+    TilePendingLayer outLayer = {};
+    outLayer.name = QString::fromStdString(inLayer.name());
 
-        for (auto const& inFeature : inLayer.features()) {
-            if (inFeature.type() != vector_tile::Tile::GeomType::Tile_GeomType_POLYGON) {
-                continue;
-            }
+    auto const& layerKeys = inLayer.keys();
+    auto const& layerValues = inLayer.values();
 
-            TilePendingFeature outFeature = {};
-
-            auto const& inTags = inFeature.tags();
-
-            // Populate the meta-data for this feature.
-            if (inTags.size() % 2 != 0) {
-                qFatal("Incorrect tag count");
-            }
-
-            for(int i = 0; i <= inTags.size() - 2; i += 2){
-                int keyIndex = inTags[i];
-                int valueIndex = inTags[i + 1];
-                auto const& key = layerKeys[keyIndex];
-                auto const& value = layerValues[valueIndex];
-
-                if (value.has_bool_value()) {
-                    outFeature.metaData.insert({ QString::fromStdString(key), value.bool_value() });
-                } else if (value.has_double_value()) {
-                    outFeature.metaData.insert({ QString::fromStdString(key), value.double_value() });
-                } else if (value.has_float_value()) {
-                    outFeature.metaData.insert({ QString::fromStdString(key), value.float_value() });
-                } else if (value.has_int_value()) {
-                    outFeature.metaData.insert({ QString::fromStdString(key), QVariant::fromValue(value.int_value()) });
-                } else if (value.has_sint_value()) {
-                    outFeature.metaData.insert({ QString::fromStdString(key), value.has_sint_value() });
-                } else if (value.has_string_value()) {
-                    outFeature.metaData.insert({
-                        QString::fromStdString(key),
-                        QString::fromStdString(value.string_value()) });
-                } else if (value.has_uint_value()) {
-                    outFeature.metaData.insert({ QString::fromStdString(key), value.has_uint_value() });
-                } else {
-                    qFatal("");
-                }
-            }
+    for (auto const& inFeature : inLayer.features()) {
+        if (inFeature.type() != vector_tile::Tile::GeomType::Tile_GeomType_POLYGON) {
+            continue;
+        }
 
-            outFeature.vtxByteOffset = decodedTile.vertices.size() * sizeof(decodedTile.vertices[0]);
-            outFeature.idxByteOffset = decodedTile.indices.size() * sizeof(decodedTile.indices[0]);
-            auto const& encodedGeometry = inFeature.geometry();
-            try {
-                auto decodedGeometry = ProtobufFeatureToPolygon(encodedGeometry);
-                for (auto const& item : decodedGeometry.first) {
-                    decodedTile.vertices.push_back({ (float)item.x, (float)item.y });
-                }
-                outFeature.idxCount = decodedGeometry.second.size();
-                for (auto const& item : decodedGeometry.second) {
-                    decodedTile.indices.push_back(item);
-                }
+        TilePendingFeature outFeature = {};
 
-            } catch (std::exception& e) {
-                // If we couldn't triangulate this one, pretend it doesn't exist
-                //qFatal("Error!!");
-                //return std::nullopt;
-                continue;
+        auto const& inTags = inFeature.tags();
+
+        // Populate the meta-data for this feature.
+        // The tiles come from the network, so nothing in them can be trusted.
+        if (inTags.size() % 2 != 0) {
+            return false;
+        }
+
+        for(int i = 0; i <= inTags.size() - 2; i += 2){
+            auto keyIndex = inTags[i];
+            auto valueIndex = inTags[i + 1];
+            if (keyIndex >= quint32(layerKeys.size()) || valueIndex >= quint32(layerValues.size())) {
+                return false;
+            }
+            auto const& key = layerKeys[keyIndex];
+            auto const& value = layerValues[valueIndex];
+
+            if (value.has_bool_value()) {
+                outFeature.metaData.insert({ QString::fromStdString(key), value.bool_value() });
+            } else if (value.has_double_value()) {
+                outFeature.metaData.insert({ QString::fromStdString(key), value.double_value() });
+            } else if (value.has_float_value()) {
+                outFeature.metaData.insert({ QString::fromStdString(key), value.float_value() });
+            } else if (value.has_int_value()) {
+                outFeature.metaData.insert({ QString::fromStdString(key), QVariant::fromValue(value.int_value()) });
+            } else if (value.has_sint_value()) {
+                outFeature.metaData.insert({ QString::fromStdString(key), value.has_sint_value() });
+            } else if (value.has_string_value()) {
+                outFeature.metaData.insert({
+                    QString::fromStdString(key),
+                    QString::fromStdString(value.string_value()) });
+            } else if (value.has_uint_value()) {
+                outFeature.metaData.insert({ QString::fromStdString(key), value.has_uint_value() });
+            } else {
+                return false;
+            }
+        }
+
+        outFeature.vtxByteOffset = decodedTile.vertices.size() * sizeof(decodedTile.vertices[0]);
+        outFeature.idxByteOffset = decodedTile.indices.size() * sizeof(decodedTile.indices[0]);
+        auto const& encodedGeometry = inFeature.geometry();
+        try {
+            auto decodedGeometry = ProtobufFeatureToPolygon(encodedGeometry);
+            for (auto const& item : decodedGeometry.first) {
+                decodedTile.vertices.push_back({ (float)item.x, (float)item.y });
+            }
+            outFeature.idxCount = decodedGeometry.second.size();
+            for (auto const& item : decodedGeometry.second) {
+                decodedTile.indices.push_back(item);
             }
 
-            outLayer.features.push_back(std::move(outFeature));
+        } catch (std::exception& e) {
+            // If we couldn't triangulate this one, pretend it doesn't exist
+            //qFatal("Error!!");
+            //return std::nullopt;
+            continue;
         }
 
-        decodedTile.layers.push_back(std::move(outLayer));
+        outLayer.features.push_back(std::move(outFeature));
     }
 
-    return decodedTile;
+    decodedTile.layers.push_back(std::move(outLayer));
+    return true;
 }
@@ -2,15 +2,21 @@
 #define TILELOADER_H
 
 #include <QObject>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QList>
 #include <QMutex>
 #include <QThreadPool>
-#include <QNetworkAccessManager>
 #include <rhi/qrhi.h>
 #include <mutex>
 
 
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
+#include <set>
+#include <unordered_map>
 
 struct TileCoord {
     int level = 0;
@@ -33,16 +39,112 @@ struct TileCoord {
     [[nodiscard]] bool operator!=(const TileCoord &other) const {
         return !(*this == other);
     }
+
+    // Packs this coord into a single 64-bit key. The top 6 bits hold the level
+    // and the lower 58 bits hold x and y interleaved in Morton order.
+    // This means tiles that are close to each other on the map get keys
+    // that are close to each other.
+    //
+    // x and y must fit in 29 bits, which covers every level up to 29.
+    [[nodiscard]] quint64 toPackedKey() const {
+        return (quint64(level) << 58) | spreadBits(x) | (spreadBits(y) << 1);
+    }
+    [[nodiscard]] static TileCoord fromPackedKey(quint64 key) {
+        return {
+            int(key >> 58),
+            int(compactBits(key)),
+            int(compactBits(key >> 1)) };
+    }
+
+private:
+    // Inserts a zero bit between each of the lower 29 bits of the input.
+    static constexpr quint64 spreadBits(quint32 value) {
+        quint64 temp = value & 0x1FFFFFFF;
+        temp = (temp | (temp << 16)) & 0x0000FFFF0000FFFF;
+        temp = (temp | (temp << 8)) & 0x00FF00FF00FF00FF;
+        temp = (temp | (temp << 4)) & 0x0F0F0F0F0F0F0F0F;
+        temp = (temp | (temp << 2)) & 0x3333333333333333;
+        temp = (temp | (temp << 1)) & 0x5555555555555555;
+        return temp;
+    }
+    // The inverse of spreadBits. Ignores every odd bit of the input.
+    static constexpr quint32 compactBits(quint64 value) {
+        quint64 temp = value & 0x0155555555555555;
+        temp = (temp | (temp >> 1)) & 0x3333333333333333;
+        temp = (temp | (temp >> 2)) & 0x0F0F0F0F0F0F0F0F;
+        temp = (temp | (temp >> 4)) & 0x00FF00FF00FF00FF;
+        temp = (temp | (temp >> 8)) & 0x0000FFFF0000FFFF;
+        temp = (temp | (temp >> 16)) & 0x00000000FFFFFFFF;
+        return quint32(temp);
+    }
+};
+
+// Describes how the viewport is currently moving. Used by the
+// TileLoader to predict which tiles will be needed soon.
+struct ViewportMotion {
+    // Velocity of the viewport center, in world-normalized coordinates per second.
+    double velocityX = 0;
+    double velocityY = 0;
+    // Zoom levels per second. Positive means zooming in.
+    double zoomVelocity = 0;
 };
 
 class TileLoaderRequestResult;
 class TileLoaderUploadResult;
+class TileSource;
+class TileDiskCache;
 
 class TileLoader : public QObject
 {
     Q_OBJECT
+    Q_PROPERTY(
+        qint64 cpuMemoryBudget
+        READ getCpuMemoryBudget
+        WRITE setCpuMemoryBudget
+        NOTIFY cpuMemoryBudgetChanged)
+
+    Q_PROPERTY(
+        qint64 gpuMemoryBudget
+        READ getGpuMemoryBudget
+        WRITE setGpuMemoryBudget
+        NOTIFY gpuMemoryBudgetChanged)
+
+    Q_PROPERTY(
+        int maxPrefetchTilesInFlight
+        READ getMaxPrefetchTilesInFlight
+        WRITE setMaxPrefetchTilesInFlight
+        NOTIFY maxPrefetchTilesInFlightChanged)
+
+    Q_PROPERTY(
+        int ioThreadCount
+        READ getIoThreadCount
+        WRITE setIoThreadCount
+        NOTIFY ioThreadCountChanged)
+
+    Q_PROPERTY(
+        int cpuThreadCount
+        READ getCpuThreadCount
+        WRITE setCpuThreadCount
+        NOTIFY cpuThreadCountChanged)
+
+    Q_PROPERTY(
+        TileSource* tileSource
+        READ getTileSource
+        WRITE setTileSource
+        NOTIFY tileSourceChanged)
+
+    Q_PROPERTY(
+        qint64 diskCacheBudget
+        READ getDiskCacheBudget
+        WRITE setDiskCacheBudget
+        NOTIFY diskCacheBudgetChanged)
+
 public:
+    // The highest zoom level the TileLoader will load.
+    static constexpr int maxZoomLevel = 15;
+
     explicit TileLoader(QObject *parent = nullptr);
+    ~TileLoader() override;
     TileLoader& operator=(const TileLoader&) = delete;
     TileLoader& operator=(TileLoader&&) = delete;
 
@@ -55,15 +157,92 @@ public:
     //
     // The return type needs some way to signal the
     // TileLoader that the tiles are no longer in use.
-    [[nodiscard]] TileLoaderRequestResult* requestTiles(QSpan<TileCoord const> tiles);
+    //
+    // If includeFallbacks is true, the result will also contain
+    // already loaded tiles that can be drawn in place of the requested tiles
+    // that are not ready yet. See TileLoaderRequestResult::fallbacks.
+    [[nodiscard]] TileLoaderRequestResult* requestTiles(
+        QSpan<TileCoord const> tiles,
+        bool includeFallbacks = false);
+
+    // Thread-safe
+    //
+    // The memory budgets decide how many bytes the loaded tiles
+    // are allowed to occupy in CPU and GPU memory respectively.
+    // When a budget is exceeded, the least recently requested tiles
+    // get evicted during the next uploadPendingTilesToRhi call.
+    //
+    // A budget of 0 means unlimited.
+    qint64 getCpuMemoryBudget() const;
+    void setCpuMemoryBudget(qint64 newValue);
+    qint64 getGpuMemoryBudget() const;
+    void setGpuMemoryBudget(qint64 newValue);
+
+    // Thread-safe
+    //
+    // Every call to requestTiles also speculatively loads tiles that
+    // are likely to become visible soon, based on the latest viewport motion.
+    // These are a ring of neighbors around the visible tiles, stretched
+    // in the direction of movement, and the next zoom level when zooming.
+    void setViewportMotion(ViewportMotion motion);
+
+    // Thread-safe
+    //
+    // Caps how many prefetched tiles can be downloading or
+    // decoding at the same time. This bounds how much bandwidth
+    // and CPU time prefetching is allowed to take away from visible tiles.
+    //
+    // A value of 0 disables prefetching.
+    int getMaxPrefetchTilesInFlight() const;
+    void setMaxPrefetchTilesInFlight(int newValue);
+
+    // Thread-safe
+    //
+    // Tile loading is split into two stages that run on separate thread pools.
+    // The I/O pool reads and writes the disk cache, and spends most of its time
+    // blocked on the disk. The CPU pool decodes and triangulates tiles.
+    //
+    // Defaults to 4 I/O threads and one CPU thread per core.
+    int getIoThreadCount() const;
+    void setIoThreadCount(int newValue);
+    int getCpuThreadCount() const;
+    void setCpuThreadCount(int newValue);
+
+    // Where tiles are loaded from when they're not in the disk cache.
+    //
+    // Defaults to the archive or directory named by the TILE_SOURCE_PMTILES,
+    // TILE_SOURCE_MBTILES or TILE_SOURCE_DIR environment variables,
+    // in that order. Otherwise MapTiler if a key is available.
+    //
+    // The TileLoader takes ownership of the source. Changing the source
+    // after tiles have been requested is not supported.
+    TileSource* getTileSource() const;
+    void setTileSource(TileSource* newValue);
+
+    // Thread-safe
+    //
+    // The amount of bytes the disk cache is allowed to use. When it grows beyond
+    // this, the tiles that have been least recently and least frequently used are
+    // evicted in the background. The lowest zoom levels are never evicted.
+    //
+    // Half of it goes to the tiles as they came from the source,
+    // the other half to the decoded tiles.
+    //
+    // Defaults to 1 GiB.
+    qint64 getDiskCacheBudget() const;
+    void setDiskCacheBudget(qint64 newValue);
 
     class TileLoaderImpl;
+    class ReadyTileSnapshot;
+    class StreamingDecode;
 
     enum class TileProgressState {
         ReadyToRender,
         Pending,
         ReadyForGpuUpload,
-        Failed, // Currently unused
+        // The tile could not be loaded. It will be loaded again
+        // when requested after StoredTile::retryDeadline.
+        Failed,
     };
 
     class TileFeature {
@@ -137,29 +316,207 @@ public:
         // Contains all indices for this tile. This includes all
         // layers and features.
         std::unique_ptr<QRhiBuffer> indexBuffer;
+
+        // Bookkeeping for the eviction policy.
+        //
+        // The value of requestTick the last time this tile was requested.
+        // This is the only member that still changes once the tile is
+        // ReadyToRender, which is why it's allowed to change through
+        // a const reference.
+        mutable std::atomic<quint64> lastRequestedTick = 0;
+        // Only relevant when the tile is Failed.
+        //
+        // Human readable description of why the tile failed to load.
+        QString failureReason;
+        // The amount of times in a row this tile has failed to load.
+        int failureCount = 0;
+        // True if the tile server told us this tile does not exist.
+        bool isKnownMissing = false;
+        // The tile will not be retried before this deadline has expired.
+        QDeadlineTimer retryDeadline;
+
+        // True if this tile was loaded speculatively by the prefetcher.
+        // Only relevant while the tile is Pending.
+        bool isPrefetch = false;
+        // Estimated memory usage of this tile, only set once the tile
+        // is ReadyToRender.
+        qint64 cpuByteSize = 0;
+        qint64 gpuByteSize = 0;
     };
 
 private:
-    // We use unique-ptr here to let use the lock in const methods.
-    std::unique_ptr<std::mutex> _tileMemoryLock = std::make_unique<std::mutex>();
-
-    // IMPORTANT: This variable is ONLY available when tileMemoryLock is locked.
-    std::map<TileCoord, std::unique_ptr<StoredTile>> tileStorage;
-
-    QThreadPool m_threadPool;
+    // The tile storage is split into shards that each have their own lock.
+    // This way the render thread and the decoder threads only contend when
+    // they happen to work on tiles in the same shard.
+    //
+    // Tiles are keyed by TileCoord::toPackedKey().
+    class TileStorageShard {
+    public:
+        std::mutex lock;
+        // IMPORTANT: This variable is ONLY available when lock is locked.
+        std::unordered_map<quint64, std::shared_ptr<StoredTile>> tiles;
+    };
+    static constexpr int tileStorageShardCount = 32;
+    // We use unique-ptr here to let use the locks in const methods.
+    std::unique_ptr<TileStorageShard[]> tileStorageShards =
+        std::make_unique<TileStorageShard[]>(tileStorageShardCount);
+
+    // The tiles that are ReadyToRender. This is what requestTiles reads from,
+    // which means the render thread can look up tiles without taking any locks.
+    // IMPORTANT: This variable must ONLY be accessed through
+    // std::atomic_load and std::atomic_store.
+    std::shared_ptr<ReadyTileSnapshot const> m_readyTiles;
+
+    // The tiles that are ReadyForGpuUpload. This lets uploadPendingTilesToRhi
+    // avoid scanning the entire tile storage every frame.
+    // IMPORTANT: This variable is ONLY available when _readyForUploadLock is locked.
+    std::vector<TileCoord> tilesReadyForUpload;
+    std::unique_ptr<std::mutex> _readyForUploadLock = std::make_unique<std::mutex>();
+
+    // Incremented once for every call to requestTiles.
+    std::atomic<quint64> requestTick = 0;
+    // The sum of the sizes of all tiles that are ReadyToRender.
+    std::atomic<qint64> cpuBytesInUse = 0;
+    std::atomic<qint64> gpuBytesInUse = 0;
+    // The amount of tiles that are Failed. They don't count towards
+    // the memory budgets, so they're capped by count instead.
+    std::atomic<int> failedTileCount = 0;
+    std::atomic<qint64> m_cpuMemoryBudget = qint64(512) * 1024 * 1024;
+    std::atomic<qint64> m_gpuMemoryBudget = qint64(256) * 1024 * 1024;
+
+    // Serializes calls to requestTiles.
+    std::unique_ptr<std::mutex> _requestLock = std::make_unique<std::mutex>();
+    // The coords passed to the most recent call to requestTiles.
+    // IMPORTANT: This variable is ONLY available when _requestLock is locked.
+    std::vector<TileCoord> lastRequestedCoords;
+    // The tiles the prefetcher picked in the most recent call to requestTiles.
+    // IMPORTANT: This variable is ONLY available when _requestLock is locked.
+    std::vector<TileCoord> lastPrefetchCoords;
+    // IMPORTANT: This variable is ONLY available when _requestLock is locked.
+    ViewportMotion m_viewportMotion;
+
+    // The amount of prefetched tiles that are currently Pending.
+    std::atomic<int> prefetchTilesInFlight = 0;
+    std::atomic<int> m_maxPrefetchTilesInFlight = 8;
+
+    // Tiles from cacheable sources are stored here. Null if the source isn't cacheable.
+    // Replaced together with m_tileSource, which can't happen once tiles have been requested.
+    //
+    // Declared before the thread pools, so that it outlives the jobs running on them.
+    std::shared_ptr<TileDiskCache> m_diskCache;
+    // Tiles that have already been decoded and triangulated, so that loading
+    // them again skips straight to the GPU upload. Exists whenever m_diskCache does.
+    std::shared_ptr<TileDiskCache> m_decodedTileCache;
+    std::atomic<qint64> m_diskCacheBudget = qint64(1024) * 1024 * 1024;
+    std::atomic<int> m_diskCacheWritesSinceMaintenance = 0;
+    // Runs eviction and compaction of the disk cache at a low priority,
+    // so they never hold up loading.
+    QThreadPool m_maintenanceThreadPool;
+
+    // Tiles waiting to be written to one of the disk caches. A newer write for
+    // the same tile replaces the one that is waiting. Keyed by the cache and
+    // TileCoord::toPackedKey().
+    // IMPORTANT: These variables are ONLY available when _pendingCacheWritesLock is locked.
+    struct PendingCacheWrite {
+        std::shared_ptr<TileDiskCache> diskCache;
+        TileCoord coord;
+        // A TileDiskCache::EntryKind, which can't be named here.
+        quint8 kind = 0;
+        QByteArray bytes;
+        QByteArray metadata;
+        // Only the metadata of the entry already in the cache is replaced.
+        // kind and bytes are unused.
+        bool metadataOnly = false;
+    };
+    std::map<std::pair<TileDiskCache*, quint64>, PendingCacheWrite> m_pendingCacheWrites;
+    bool m_cacheWriteBackScheduled = false;
+    std::unique_ptr<std::mutex> _pendingCacheWritesLock = std::make_unique<std::mutex>();
+    // Drains m_pendingCacheWrites in batches, at a low priority.
+    QThreadPool m_writeBackThreadPool;
+
+    // Runs disk cache reads and tile source fetches.
+    QThreadPool m_ioThreadPool;
+    // Runs tile decoding and triangulation.
+    QThreadPool m_cpuThreadPool;
+
+    // Jobs waiting for a free thread in their thread pool, along with the
+    // information used to decide which one is the most urgent.
+    // IMPORTANT: These variables are ONLY available when _pendingJobsLock is locked.
+    struct PendingJob {
+        TileCoord coord;
+        std::function<void()> fn;
+    };
+    std::vector<PendingJob> m_pendingIoJobs;
+    std::vector<PendingJob> m_pendingCpuJobs;
+    struct JobFocus {
+        // Center of the visible tiles in world-normalized coordinates.
+        double x = 0.5;
+        double y = 0.5;
+        // The zoom level currently being displayed.
+        int zoom = 0;
+        // The range of visible tiles at the zoom level being displayed.
+        // Anything outside is speculative.
+        int minTileX = 0;
+        int maxTileX = 0;
+        int minTileY = 0;
+        int maxTileY = 0;
+    };
+    JobFocus m_jobFocus;
+    // Set once the TileLoader starts shutting down. No new jobs are accepted after that.
+    bool m_jobsStopped = false;
+    std::unique_ptr<std::mutex> _pendingJobsLock = std::make_unique<std::mutex>();
     struct ProtobufArenaBaseType {
         virtual ~ProtobufArenaBaseType() {}
     };
     std::vector<std::pair<Qt::HANDLE, std::unique_ptr<ProtobufArenaBaseType>>> m_protobufArenas;
     std::unique_ptr<std::mutex> _protobufArenasLock = std::make_unique<std::mutex>();
 
-    QNetworkAccessManager m_networkAccessMgr;
-    QString m_maptilerKey = {};
+    // Tiles that have finished loading since the last tilesLoaded signal.
+    // IMPORTANT: These variables are ONLY available when _notifyLock is locked.
+    QList<TileCoord> m_loadedTilesToNotify;
+    QList<TileCoord> m_failedTilesToNotify;
+    bool m_notifyScheduled = false;
+    std::unique_ptr<std::mutex> _notifyLock = std::make_unique<std::mutex>();
+    // Time since tilesLoaded was last emitted.
+    // IMPORTANT: This variable is ONLY available on the TileLoader's thread.
+    QElapsedTimer m_lastNotifyTimer;
+    static constexpr int minNotifyIntervalMs = 16;
+
+    // Can't be changed once tiles have been requested.
+    std::atomic<TileSource*> m_tileSource = nullptr;
+    // The fetches from m_tileSource that are currently in progress, along with
+    // an id that is unique to each fetch. A tile can be fetched again after its
+    // fetch was cancelled, and the id tells a late result of the cancelled fetch
+    // apart from the result of the new one.
+    // IMPORTANT: These variables are ONLY available when _activeFetchesLock is locked.
+    std::map<TileCoord, quint64> m_activeFetches;
+    quint64 m_nextFetchId = 0;
+    std::unique_ptr<std::mutex> _activeFetchesLock = std::make_unique<std::mutex>();
+    // Big tiles that are being decoded layer by layer while they download.
+    // Entries only exist for active fetches.
+    // IMPORTANT: This variable is ONLY available when _streamingDecodesLock is locked.
+    std::map<TileCoord, std::shared_ptr<StreamingDecode>> m_streamingDecodes;
+    std::unique_ptr<std::mutex> _streamingDecodesLock = std::make_unique<std::mutex>();
+    // Cached tiles that have gone stale, which the source is being asked about.
+    // These are separate from m_activeFetches, they never affect the loaded tiles.
+    // IMPORTANT: This variable is ONLY available when _activeRevalidationsLock is locked.
+    std::set<TileCoord> m_activeRevalidations;
+    std::unique_ptr<std::mutex> _activeRevalidationsLock = std::make_unique<std::mutex>();
 
     friend TileLoaderImpl;
 
 signals:
-    void tileLoaded(bool success, TileCoord tile);
+    // Emitted when tiles have finished loading, either successfully or not.
+    // Tiles that finish close together are batched into a single signal,
+    // which is emitted at most once per frame interval.
+    void tilesLoaded(QList<TileCoord> loadedTiles, QList<TileCoord> failedTiles);
+    void cpuMemoryBudgetChanged();
+    void gpuMemoryBudgetChanged();
+    void maxPrefetchTilesInFlightChanged();
+    void ioThreadCountChanged();
+    void cpuThreadCountChanged();
+    void tileSourceChanged();
+    void diskCacheBudgetChanged();
 };
 
 class TileLoaderRequestResult : public QObject{
@@ -172,8 +529,35 @@ public:
     TileLoaderRequestResult() : QObject(nullptr) {
 
     }
+    // Destroying the result lets the TileLoader free any tiles
+    // in it that have since been evicted. This should happen on
+    // the render thread, once the frame using the tiles has been submitted.
     virtual ~TileLoaderRequestResult() {}
     std::map<TileCoord, TileLoader::StoredTile const*> tiles;
+
+    // A loaded tile that can be drawn in place of a requested tile
+    // that is not ready yet.
+    class FallbackTile {
+    public:
+        // The coord of the loaded tile. This is either an ancestor
+        // or a child of the requested tile.
+        TileCoord coord;
+        TileLoader::StoredTile const* tile = nullptr;
+        // When drawing this tile, only the area covered by this coord
+        // should be drawn. This is always the fallback tile itself or
+        // one of its descendants.
+        TileCoord clipTo;
+    };
+    // Maps each requested coord that is not ready to the tiles that
+    // together cover its area. Only filled in when requested.
+    std::map<TileCoord, std::vector<FallbackTile>> fallbacks;
+
+private:
+    // Keeps every tile in this result alive, even if
+    // the TileLoader evicts them in the meantime.
+    std::shared_ptr<TileLoader::ReadyTileSnapshot const> m_snapshot;
+
+    friend TileLoader::TileLoaderImpl;
 };
 
 class TileLoaderUploadResult : public QObject {
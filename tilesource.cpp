@@ -0,0 +1,569 @@
+#include "tilesource.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QNetworkReply>
+#include <QScopeGuard>
+
+#include <algorithm>
+
+#include <zlib.h>
+
+static QString expandTileTemplate(QString pattern, TileCoord coord)
+{
+    pattern.replace("{x}", QString::number(coord.x));
+    pattern.replace("{y}", QString::number(coord.y));
+    pattern.replace("{z}", QString::number(coord.level));
+    return pattern;
+}
+
+void TileSource::fetchTiles(std::vector<TileCoord> const& coords, BatchFetchCallback callback)
+{
+    for (auto const& coord : coords) {
+        fetchTile(coord, [=](TileFetchResult result) {
+            callback(coord, std::move(result));
+        });
+    }
+}
+
+void TileSource::revalidateTile(TileCoord coord, TileValidators const&, FetchCallback callback)
+{
+    fetchTile(coord, std::move(callback));
+}
+
+void TileSource::setFetchPriorityFunction(FetchPriorityFn fn)
+{
+    auto autoLock = std::lock_guard{ *_fetchPriorityLock };
+    m_fetchPriorityFn = std::move(fn);
+}
+
+double TileSource::calcFetchPriority(TileCoord coord) const
+{
+    auto autoLock = std::lock_guard{ *_fetchPriorityLock };
+    return m_fetchPriorityFn ? m_fetchPriorityFn(coord) : 0.0;
+}
+
+void TileSource::setFetchProgressFunction(FetchProgressFn fn)
+{
+    auto autoLock = std::lock_guard{ *_fetchProgressLock };
+    m_fetchProgressFn = std::move(fn);
+}
+
+void TileSource::reportFetchProgress(TileCoord coord, QByteArray const& bytesSoFar, qint64 expectedSize) const
+{
+    auto autoLock = std::lock_guard{ *_fetchProgressLock };
+    if (m_fetchProgressFn) {
+        m_fetchProgressFn(coord, bytesSoFar, expectedSize);
+    }
+}
+
+std::optional<QByteArray> decompressTileBytesIfGzipped(QByteArray const& bytes)
+{
+    bool isGzipped =
+        bytes.size() >= 2 &&
+        quint8(bytes[0]) == 0x1f &&
+        quint8(bytes[1]) == 0x8b;
+    if (!isGzipped) {
+        return bytes;
+    }
+
+    z_stream stream = {};
+    // Adding 16 to the window bits tells zlib to expect a gzip header.
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        return std::nullopt;
+    }
+    auto streamCleanup = QScopeGuard{ [&]() { inflateEnd(&stream); } };
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(bytes.data()));
+    stream.avail_in = uInt(bytes.size());
+
+    // Vector tiles typically compress to a quarter of their size.
+    QByteArray output;
+    output.resize(bytes.size() * 4);
+    qsizetype outputSize = 0;
+    while (true) {
+        if (outputSize == output.size()) {
+            output.resize(output.size() * 2);
+        }
+        stream.next_out = reinterpret_cast<Bytef*>(output.data() + outputSize);
+        stream.avail_out = uInt(output.size() - outputSize);
+
+        int result = inflate(&stream, Z_NO_FLUSH);
+        outputSize = output.size() - stream.avail_out;
+        if (result == Z_STREAM_END) {
+            break;
+        }
+        if (result != Z_OK) {
+            return std::nullopt;
+        }
+    }
+    output.resize(outputSize);
+    return output;
+}
+
+HttpTileSource::HttpTileSource(QObject* parent) : TileSource{ parent }
+{
+    m_networkThread.setObjectName("HttpTileSource network");
+    m_networkAccessMgr = new QNetworkAccessManager;
+    m_networkAccessMgr->moveToThread(&m_networkThread);
+    m_networkThread.start();
+}
+
+HttpTileSource::~HttpTileSource()
+{
+    // Any reply still in flight is a child of the manager. The thread deletes
+    // them all on its way out, so no callback can run after this returns.
+    m_networkAccessMgr->deleteLater();
+    m_networkThread.quit();
+    m_networkThread.wait();
+}
+
+HttpTileSource* HttpTileSource::createMapTilerSource(QObject* parent)
+{
+    QString maptilerKey;
+#ifdef MAPTILER_KEY
+    maptilerKey = MAPTILER_KEY;
+#endif
+    if (maptilerKey == "") {
+        // Check for the environment variable for MapTiler key.
+        maptilerKey = qEnvironmentVariable("MAPTILER_KEY");
+    }
+
+    if (maptilerKey == "") {
+        return nullptr;
+    }
+
+    auto* source = new HttpTileSource(parent);
+    source->setUrlTemplate("https://api.maptiler.com/tiles/v3/{z}/{x}/{y}.pbf?key=" + maptilerKey);
+    source->setCacheName("maptiler_planet");
+    return source;
+}
+
+QString HttpTileSource::getUrlTemplate() const
+{
+    auto autoLock = std::lock_guard{ *_propertiesLock };
+    return m_urlTemplate;
+}
+
+void HttpTileSource::setUrlTemplate(QString const& newValue)
+{
+    bool changed = false;
+    {
+        auto autoLock = std::lock_guard{ *_propertiesLock };
+        changed = newValue != m_urlTemplate;
+        m_urlTemplate = newValue;
+    }
+    if (changed) {
+        emit urlTemplateChanged();
+    }
+}
+
+QString HttpTileSource::getCacheName() const
+{
+    auto autoLock = std::lock_guard{ *_propertiesLock };
+    return m_cacheName;
+}
+
+void HttpTileSource::setCacheName(QString const& newValue)
+{
+    bool changed = false;
+    {
+        auto autoLock = std::lock_guard{ *_propertiesLock };
+        changed = newValue != m_cacheName;
+        m_cacheName = newValue;
+    }
+    if (changed) {
+        emit cacheNameChanged();
+    }
+}
+
+int HttpTileSource::getMaxRequestsPerHost() const
+{
+    return m_maxRequestsPerHost;
+}
+
+void HttpTileSource::setMaxRequestsPerHost(int newValue)
+{
+    newValue = std::max(newValue, 1);
+    bool changed = m_maxRequestsPerHost.exchange(newValue) != newValue;
+    if (!changed) {
+        return;
+    }
+    // If the limit went up, there might be room for more requests.
+    QMetaObject::invokeMethod(
+        m_networkAccessMgr,
+        [this]() { startQueuedFetches(); });
+    emit maxRequestsPerHostChanged();
+}
+
+void HttpTileSource::fetchTile(TileCoord coord, FetchCallback callback)
+{
+    QueuedFetch fetch;
+    fetch.coord = coord;
+    fetch.url = QUrl{ expandTileTemplate(getUrlTemplate(), coord) };
+    fetch.callback = std::move(callback);
+    enqueueFetch(std::move(fetch));
+}
+
+void HttpTileSource::revalidateTile(TileCoord coord, TileValidators const& validators, FetchCallback callback)
+{
+    QueuedFetch fetch;
+    fetch.coord = coord;
+    fetch.url = QUrl{ expandTileTemplate(getUrlTemplate(), coord) };
+    fetch.callback = std::move(callback);
+    fetch.validators = validators;
+    enqueueFetch(std::move(fetch));
+}
+
+void HttpTileSource::enqueueFetch(QueuedFetch&& fetch)
+{
+    // Requests need to be started on the same thread as the NetworkAccessManager.
+    QMetaObject::invokeMethod(
+        m_networkAccessMgr,
+        [this, fetch = std::move(fetch)]() mutable {
+            // When a burst of fetches comes in, most of them just wait. Sorting
+            // the queue is only worth it if one of them can actually start.
+            auto host = fetch.url.host();
+            m_queuedFetches.push_back(std::move(fetch));
+            auto it = m_requestsInFlightPerHost.find(host);
+            if (it == m_requestsInFlightPerHost.end() || it->second < m_maxRequestsPerHost) {
+                startQueuedFetches();
+            }
+        });
+}
+
+void HttpTileSource::cancelFetch(TileCoord coord)
+{
+    QMetaObject::invokeMethod(
+        m_networkAccessMgr,
+        [=, this]() {
+            auto queuedIt = std::find_if(
+                m_queuedFetches.begin(),
+                m_queuedFetches.end(),
+                [&](QueuedFetch const& fetch) { return fetch.coord == coord && !fetch.validators.has_value(); });
+            if (queuedIt != m_queuedFetches.end()) {
+                m_queuedFetches.erase(queuedIt);
+                return;
+            }
+
+            auto it = m_activeRequests.find({ coord, false });
+            if (it == m_activeRequests.end()) {
+                return;
+            }
+            auto reply = it->second.reply;
+            auto host = it->second.host;
+            m_activeRequests.erase(it);
+            // The finished-signal will fire with OperationCanceledError,
+            // handleReply takes care of ignoring those.
+            reply->abort();
+            releaseHostSlot(host);
+        });
+}
+
+void HttpTileSource::startQueuedFetches()
+{
+    if (m_queuedFetches.empty()) {
+        return;
+    }
+
+    // Look up the priorities once, they can't change the order while we sort.
+    std::vector<std::pair<double, size_t>> order;
+    order.reserve(m_queuedFetches.size());
+    for (size_t i = 0; i < m_queuedFetches.size(); i++) {
+        order.push_back({ calcFetchPriority(m_queuedFetches[i].coord), i });
+    }
+    std::sort(order.begin(), order.end());
+
+    int maxRequestsPerHost = m_maxRequestsPerHost;
+    std::vector<bool> started(m_queuedFetches.size(), false);
+    for (auto const& [priority, index] : order) {
+        auto& inFlight = m_requestsInFlightPerHost[m_queuedFetches[index].url.host()];
+        if (inFlight >= maxRequestsPerHost) {
+            continue;
+        }
+        inFlight++;
+        started[index] = true;
+        startFetch(std::move(m_queuedFetches[index]));
+    }
+
+    std::vector<QueuedFetch> stillQueued;
+    for (size_t i = 0; i < m_queuedFetches.size(); i++) {
+        if (!started[i]) {
+            stillQueued.push_back(std::move(m_queuedFetches[i]));
+        }
+    }
+    m_queuedFetches = std::move(stillQueued);
+}
+
+void HttpTileSource::releaseHostSlot(QString const& host)
+{
+    auto it = m_requestsInFlightPerHost.find(host);
+    if (it != m_requestsInFlightPerHost.end() && --it->second <= 0) {
+        m_requestsInFlightPerHost.erase(it);
+    }
+    startQueuedFetches();
+}
+
+void HttpTileSource::startFetch(QueuedFetch&& fetch)
+{
+    QNetworkRequest req = { };
+    req.setUrl(fetch.url);
+    // Lets many requests share a single connection, when the server supports it.
+    // Connections are kept alive between requests either way.
+    req.setAttribute(QNetworkRequest::Http2AllowedAttribute, true);
+    if (fetch.validators.has_value()) {
+        // The server only sends the tile if neither of these match.
+        if (!fetch.validators->etag.isEmpty()) {
+            req.setRawHeader("If-None-Match", fetch.validators->etag);
+        }
+        if (!fetch.validators->lastModified.isEmpty()) {
+            req.setRawHeader("If-Modified-Since", fetch.validators->lastModified);
+        }
+    }
+
+    RequestKey key = { fetch.coord, fetch.validators.has_value() };
+
+    // The same tile can be requested again before the cancellation of the
+    // earlier request has been processed. The newer request replaces it,
+    // otherwise its reply would never be tracked and its callback never called.
+    auto existingIt = m_activeRequests.find(key);
+    if (existingIt != m_activeRequests.end()) {
+        auto oldReply = existingIt->second.reply;
+        auto oldHost = existingIt->second.host;
+        m_activeRequests.erase(existingIt);
+        // handleReply ignores the finished-signal, same as in cancelFetch.
+        oldReply->abort();
+        // Not releaseHostSlot, we might be in the middle of startQueuedFetches.
+        auto hostIt = m_requestsInFlightPerHost.find(oldHost);
+        if (hostIt != m_requestsInFlightPerHost.end() && --hostIt->second <= 0) {
+            m_requestsInFlightPerHost.erase(hostIt);
+        }
+    }
+
+    auto reply = m_networkAccessMgr->get(req);
+    m_activeRequests.insert({ key, { reply, fetch.url.host(), {} } });
+    // The manager is the context, so that the reply is handled on the
+    // network thread rather than the thread this source lives on.
+    QObject::connect(
+        reply,
+        &QNetworkReply::readyRead,
+        m_networkAccessMgr,
+        [this, key, reply]() { handleReadyRead(key, reply); });
+    QObject::connect(
+        reply,
+        &QNetworkReply::finished,
+        m_networkAccessMgr,
+        [this, key, reply, callback = std::move(fetch.callback)]() {
+            handleReply(key, reply, callback);
+        });
+}
+
+void HttpTileSource::handleReadyRead(RequestKey key, QNetworkReply* reply)
+{
+    auto activeIt = m_activeRequests.find(key);
+    if (activeIt == m_activeRequests.end() || activeIt->second.reply != reply) {
+        return;
+    }
+    auto& bytes = activeIt->second.bytes;
+
+    // Size the buffer for the whole body up front, so appending never reallocates.
+    // If the body is compressed, Content-Length is the compressed size, which
+    // says little about the size of the tile.
+    qint64 expectedSize = -1;
+    auto contentLength = reply->header(QNetworkRequest::ContentLengthHeader);
+    auto contentEncoding = reply->rawHeader("Content-Encoding").trimmed().toLower();
+    bool isEncoded = !contentEncoding.isEmpty() && contentEncoding != "identity";
+    if (contentLength.isValid() && !isEncoded) {
+        expectedSize = contentLength.toLongLong();
+        if (bytes.isEmpty() && expectedSize > 0) {
+            bytes.reserve(qsizetype(expectedSize));
+        }
+    }
+
+    auto chunkSize = reply->bytesAvailable();
+    auto oldSize = bytes.size();
+    bytes.resize(oldSize + qsizetype(chunkSize));
+    auto bytesRead = reply->read(bytes.data() + oldSize, chunkSize);
+    bytes.resize(oldSize + qsizetype(std::max<qint64>(bytesRead, 0)));
+
+    // Error pages are never worth decoding.
+    auto httpStatus = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    auto contentType = reply->header(QNetworkRequest::ContentTypeHeader);
+    bool isRevalidation = key.second;
+    if (httpStatus == 200 && contentType == "application/x-protobuf" && !isRevalidation) {
+        reportFetchProgress(key.first, bytes, expectedSize);
+    }
+}
+
+// Reads the validators and the expiry out of the response headers.
+static TileValidators readValidators(QNetworkReply* reply)
+{
+    TileValidators validators;
+    validators.etag = reply->rawHeader("ETag");
+    validators.lastModified = reply->rawHeader("Last-Modified");
+
+    auto nowSecs = QDateTime::currentSecsSinceEpoch();
+    // Cache-Control takes precedence over Expires. The response might
+    // have spent some time in a cache on the way, which Age tells us.
+    auto ageSecs = std::max(reply->rawHeader("Age").trimmed().toLongLong(), qint64(0));
+    for (auto directive : reply->rawHeader("Cache-Control").split(',')) {
+        directive = directive.trimmed().toLower();
+        if (directive == "no-cache" || directive == "no-store") {
+            validators.expiresAtSecs = nowSecs;
+            return validators;
+        }
+        if (directive.startsWith("max-age=")) {
+            bool ok = false;
+            auto maxAgeSecs = directive.mid(8).toLongLong(&ok);
+            if (ok) {
+                validators.expiresAtSecs = nowSecs + std::max(maxAgeSecs - ageSecs, qint64(0));
+                return validators;
+            }
+        }
+    }
+
+    auto expires = reply->rawHeader("Expires");
+    if (!expires.isEmpty()) {
+        auto expiresAt = QDateTime::fromString(QString::fromLatin1(expires), Qt::RFC2822Date);
+        // An invalid date, usually "0", means it has already expired.
+        validators.expiresAtSecs = expiresAt.isValid() ? expiresAt.toSecsSinceEpoch() : nowSecs;
+    }
+    return validators;
+}
+
+void HttpTileSource::handleReply(RequestKey key, QNetworkReply* reply, FetchCallback const& callback)
+{
+    // This will be called on the thread belonging to the QNetworkAccessManager.
+    reply->deleteLater();
+
+    if (!reply->isFinished()) {
+        qFatal("Developer error");
+    }
+
+    auto activeIt = m_activeRequests.find(key);
+    if (activeIt == m_activeRequests.end() || activeIt->second.reply != reply) {
+        // This request was aborted by cancelFetch,
+        // which has already removed it.
+        return;
+    }
+    auto host = activeIt->second.host;
+    // Whatever hasn't gone through handleReadyRead yet is still in the reply.
+    auto bytes = std::move(activeIt->second.bytes);
+    bytes.append(reply->readAll());
+    m_activeRequests.erase(activeIt);
+    releaseHostSlot(host);
+
+    TileFetchResult result;
+
+    // Tile servers answer with either 404 or 204 for tiles
+    // that don't exist, typically over the ocean at high zoom levels.
+    int httpStatus = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (httpStatus == 304) {
+        result.status = TileFetchResult::Status::NotModified;
+        result.validators = readValidators(reply);
+        callback(std::move(result));
+        return;
+    }
+    if (httpStatus == 404 || httpStatus == 204) {
+        result.status = TileFetchResult::Status::NotFound;
+        result.errorString = QString("Tile server responded with %1.").arg(httpStatus);
+        callback(std::move(result));
+        return;
+    }
+
+    if (reply->error() != QNetworkReply::NoError) {
+        result.status = TileFetchResult::Status::Error;
+        result.errorString = reply->errorString();
+
+        QVariant contentType = reply->header(QNetworkRequest::ContentTypeHeader);
+        if (contentType == "text/plain;charset=UTF-8") {
+            result.errorString += " " + QString::fromUtf8(bytes);
+        }
+
+        callback(std::move(result));
+        return;
+    }
+
+    QVariant contentType = reply->header(QNetworkRequest::ContentTypeHeader);
+    if (contentType != "application/x-protobuf") {
+        // We got back an unexpected reply.
+        result.status = TileFetchResult::Status::Error;
+        result.errorString = "Unexpected content type: " + contentType.toString();
+        callback(std::move(result));
+        return;
+    }
+
+    result.status = TileFetchResult::Status::Success;
+    result.bytes = std::move(bytes);
+    result.validators = readValidators(reply);
+    callback(std::move(result));
+}
+
+LocalDirectoryTileSource::LocalDirectoryTileSource(QObject* parent) : TileSource{ parent } {}
+
+QString LocalDirectoryTileSource::getPath() const
+{
+    auto autoLock = std::lock_guard{ *_propertiesLock };
+    return m_path;
+}
+
+void LocalDirectoryTileSource::setPath(QString const& newValue)
+{
+    bool changed = false;
+    {
+        auto autoLock = std::lock_guard{ *_propertiesLock };
+        changed = newValue != m_path;
+        m_path = newValue;
+    }
+    if (changed) {
+        emit pathChanged();
+    }
+}
+
+QString LocalDirectoryTileSource::getFileNameTemplate() const
+{
+    auto autoLock = std::lock_guard{ *_propertiesLock };
+    return m_fileNameTemplate;
+}
+
+void LocalDirectoryTileSource::setFileNameTemplate(QString const& newValue)
+{
+    bool changed = false;
+    {
+        auto autoLock = std::lock_guard{ *_propertiesLock };
+        changed = newValue != m_fileNameTemplate;
+        m_fileNameTemplate = newValue;
+    }
+    if (changed) {
+        emit fileNameTemplateChanged();
+    }
+}
+
+void LocalDirectoryTileSource::fetchTile(TileCoord coord, FetchCallback callback)
+{
+    auto filePath = QDir::cleanPath(
+        getPath() + QDir::separator() +
+        expandTileTemplate(getFileNameTemplate(), coord));
+
+    TileFetchResult result;
+
+    QFile file { filePath };
+    if (!file.exists()) {
+        result.status = TileFetchResult::Status::NotFound;
+        result.errorString = "No such tile file: " + filePath;
+        callback(std::move(result));
+        return;
+    }
+
+    if (!file.open(QFile::ReadOnly)) {
+        result.status = TileFetchResult::Status::Error;
+        result.errorString = "Unable to open tile file: " + file.errorString();
+        callback(std::move(result));
+        return;
+    }
+
+    result.status = TileFetchResult::Status::Success;
+    result.bytes = file.readAll();
+    callback(std::move(result));
+}
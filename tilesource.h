@@ -0,0 +1,359 @@
+#ifndef TILESOURCE_H
+#define TILESOURCE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QNetworkAccessManager>
+#include <QString>
+#include <QThread>
+#include <QUrl>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "tileloader.h"
+
+class QNetworkReply;
+
+// What a source told us about how long a tile stays fresh,
+// and how to ask whether it has changed once it's not.
+class TileValidators {
+public:
+    // The ETag and Last-Modified headers of an HTTP response, as they were sent.
+    QByteArray etag;
+    QByteArray lastModified;
+    // When the tile goes stale, in seconds since epoch.
+    // 0 if the source didn't say.
+    qint64 expiresAtSecs = 0;
+
+    bool hasAny() const { return !etag.isEmpty() || !lastModified.isEmpty(); }
+};
+
+// The outcome of fetching a single tile from a TileSource.
+class TileFetchResult {
+public:
+    enum class Status {
+        Success,
+        // The source doesn't have this tile, and never will.
+        // The TileLoader caches this negatively.
+        NotFound,
+        // Something went wrong. The TileLoader will retry later.
+        Error,
+        // Only for revalidations. The tile hasn't changed,
+        // so no bytes were sent, but the validators are fresh.
+        NotModified,
+    };
+    Status status = Status::Error;
+    // The raw Mapbox Vector Tile bytes. Only set on Success.
+    QByteArray bytes;
+    // Set on Success and NotModified, by sources that have them.
+    TileValidators validators;
+    // Human readable description of what went wrong. Only set on failure.
+    QString errorString;
+};
+
+// Somewhere the TileLoader can get vector tiles from.
+//
+// Implementations exist for HTTP tile servers and for a directory of tiles
+// on the local filesystem. Archive formats like MBTiles and PMTiles fit
+// in here too, by serving tiles out of a single file.
+class TileSource : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TileSource(QObject* parent = nullptr) : QObject{ parent } {}
+    virtual ~TileSource() {}
+
+    using FetchCallback = std::function<void(TileFetchResult)>;
+
+    // Thread-safe
+    //
+    // Starts fetching the tile. The callback is invoked exactly once when the fetch
+    // is done, unless the fetch was cancelled. The callback can be invoked on any
+    // thread, and possibly before fetchTile returns.
+    virtual void fetchTile(TileCoord coord, FetchCallback callback) = 0;
+
+    using BatchFetchCallback = std::function<void(TileCoord, TileFetchResult)>;
+
+    // Thread-safe
+    //
+    // Fetches several tiles at once, for sources where that is cheaper than
+    // fetching them one by one. The coords are sorted from most to least urgent.
+    // The callback is invoked once for every tile, following the same rules
+    // as fetchTile.
+    //
+    // The default implementation calls fetchTile for every tile.
+    virtual void fetchTiles(std::vector<TileCoord> const& coords, BatchFetchCallback callback);
+
+    // Thread-safe
+    //
+    // Returns true if the TileLoader should hand this source all the tiles it
+    // requests at once through fetchTiles, as a single job. Otherwise every tile
+    // is scheduled on its own, so the most urgent ones are read first and the
+    // reads spread out over the I/O threads.
+    virtual bool prefersBatchedFetches() const { return false; }
+
+    // Thread-safe
+    //
+    // Asks the source whether a tile we already have has changed since it
+    // handed out the validators. Responds with NotModified if it hasn't, or with
+    // the new tile if it has. Follows the same rules as fetchTile, except that
+    // it can't be cancelled, and it never reports progress.
+    //
+    // The default implementation fetches the whole tile.
+    virtual void revalidateTile(TileCoord coord, TileValidators const& validators, FetchCallback callback);
+
+    // Thread-safe
+    //
+    // Cancels an in-progress fetch. The callback of a cancelled fetch
+    // might still be invoked if it was already on its way.
+    // The TileLoader takes care of ignoring those.
+    virtual void cancelFetch(TileCoord coord) {}
+
+    // Thread-safe
+    //
+    // Returns true if tiles from this source should be stored in
+    // the TileLoader's disk cache. Sources that are already on
+    // the local filesystem gain nothing from this.
+    virtual bool isCacheable() const = 0;
+
+    // Thread-safe
+    //
+    // Name of the folder inside the disk cache that this source's tiles are
+    // stored in. Two sources that serve the same tiles can share this.
+    virtual QString getCacheName() const = 0;
+
+    // Lower value means more urgent.
+    using FetchPriorityFn = std::function<double(TileCoord)>;
+
+    // Thread-safe
+    //
+    // Set by the TileLoader. Sources that can't start every fetch right away
+    // use this to pick which of the waiting fetches goes next. Priorities change
+    // as the viewport moves, so they should be looked up at the time of picking.
+    //
+    // Once this returns, the previous function is guaranteed not to be running.
+    void setFetchPriorityFunction(FetchPriorityFn fn);
+
+    // Receives the bytes of a tile that have arrived so far, along with the
+    // size the whole tile is expected to have, or -1 if that isn't known.
+    using FetchProgressFn = std::function<void(TileCoord, QByteArray const& bytesSoFar, qint64 expectedSize)>;
+
+    // Thread-safe
+    //
+    // Set by the TileLoader. Sources that receive tiles bit by bit report their
+    // progress through this, which lets the TileLoader start decoding before the
+    // whole tile has arrived. The fetch callback still gets all of the bytes.
+    //
+    // Once this returns, the previous function is guaranteed not to be running.
+    void setFetchProgressFunction(FetchProgressFn fn);
+
+protected:
+    // Thread-safe
+    //
+    // Returns 0 for every tile if no priority function is set.
+    double calcFetchPriority(TileCoord coord) const;
+
+    // Thread-safe
+    void reportFetchProgress(TileCoord coord, QByteArray const& bytesSoFar, qint64 expectedSize) const;
+
+private:
+    // IMPORTANT: This variable is ONLY available when _fetchPriorityLock is locked.
+    FetchPriorityFn m_fetchPriorityFn;
+    // Held while the function runs, see setFetchPriorityFunction.
+    std::unique_ptr<std::mutex> _fetchPriorityLock = std::make_unique<std::mutex>();
+
+    // IMPORTANT: This variable is ONLY available when _fetchProgressLock is locked.
+    FetchProgressFn m_fetchProgressFn;
+    // Held while the function runs, see setFetchProgressFunction.
+    std::unique_ptr<std::mutex> _fetchProgressLock = std::make_unique<std::mutex>();
+};
+
+// Tiles stored in archives are often gzip-compressed.
+// Returns the bytes as-is if they're not gzip-compressed,
+// and std::nullopt if they're corrupt.
+std::optional<QByteArray> decompressTileBytesIfGzipped(QByteArray const& bytes);
+
+// Fetches tiles from a tile server over HTTP.
+//
+// All networking runs on a thread of its own, so that starting requests and
+// reading replies never competes with the GUI thread.
+//
+// Only a limited amount of requests are in flight per host at any time. The
+// rest wait in a queue, and whenever a request finishes, the most urgent
+// waiting one is started. This keeps a burst of requests from flooding the
+// server, and lets the tiles the user is looking at right now go first.
+//
+// Revalidations are sent as conditional requests, using If-None-Match and
+// If-Modified-Since, and a 304 response becomes NotModified.
+class HttpTileSource : public TileSource
+{
+    Q_OBJECT
+    Q_PROPERTY(
+        QString urlTemplate
+        READ getUrlTemplate
+        WRITE setUrlTemplate
+        NOTIFY urlTemplateChanged)
+
+    Q_PROPERTY(
+        int maxRequestsPerHost
+        READ getMaxRequestsPerHost
+        WRITE setMaxRequestsPerHost
+        NOTIFY maxRequestsPerHostChanged)
+
+    Q_PROPERTY(
+        QString cacheName
+        READ getCacheName
+        WRITE setCacheName
+        NOTIFY cacheNameChanged)
+
+public:
+    explicit HttpTileSource(QObject* parent = nullptr);
+    ~HttpTileSource() override;
+
+    // Returns the default MapTiler source, using the key from either the
+    // MAPTILER_KEY define or the MAPTILER_KEY environment variable.
+    // Returns nullptr if no key is available.
+    static HttpTileSource* createMapTilerSource(QObject* parent = nullptr);
+
+    // The URL of a tile, where {z}, {x} and {y} are replaced
+    // with the level and the coordinates of the tile.
+    //
+    // Example: https://tiles.example.com/{z}/{x}/{y}.pbf
+    //
+    // Should be set before the TileLoader starts requesting tiles.
+    QString getUrlTemplate() const;
+    void setUrlTemplate(QString const& newValue);
+
+    QString getCacheName() const override;
+    void setCacheName(QString const& newValue);
+
+    // Thread-safe
+    //
+    // The amount of requests to a single host that can be in flight at once.
+    // Requests are sent over HTTP/2 when the server supports it, in which case
+    // they share one connection. Otherwise, Qt opens up to 6 connections per host.
+    //
+    // Defaults to 16.
+    int getMaxRequestsPerHost() const;
+    void setMaxRequestsPerHost(int newValue);
+
+    void fetchTile(TileCoord coord, FetchCallback callback) override;
+    void revalidateTile(TileCoord coord, TileValidators const& validators, FetchCallback callback) override;
+    void cancelFetch(TileCoord coord) override;
+    bool isCacheable() const override { return true; }
+
+private:
+    struct QueuedFetch {
+        TileCoord coord;
+        QUrl url;
+        FetchCallback callback;
+        // Only set for revalidations.
+        std::optional<TileValidators> validators;
+    };
+
+    // A revalidation can be in flight for the same tile as a regular fetch,
+    // so the two are kept apart. The bool is true for revalidations.
+    using RequestKey = std::pair<TileCoord, bool>;
+
+    void enqueueFetch(QueuedFetch&& fetch);
+
+    // These must be called on m_networkThread.
+    //
+    // Starts the most urgent queued fetches, as long as their hosts have room.
+    void startQueuedFetches();
+    void startFetch(QueuedFetch&& fetch);
+    void handleReadyRead(RequestKey key, QNetworkReply* reply);
+    void handleReply(RequestKey key, QNetworkReply* reply, FetchCallback const& callback);
+    void releaseHostSlot(QString const& host);
+
+    // IMPORTANT: These variables are ONLY available when _propertiesLock is locked.
+    QString m_urlTemplate;
+    QString m_cacheName = "default";
+    std::unique_ptr<std::mutex> _propertiesLock = std::make_unique<std::mutex>();
+
+    // Runs the event loop that the NetworkAccessManager and its replies live on.
+    QThread m_networkThread;
+    // Lives on m_networkThread, and is deleted there when the thread finishes.
+    QNetworkAccessManager* m_networkAccessMgr = nullptr;
+    std::atomic<int> m_maxRequestsPerHost = 16;
+
+    // IMPORTANT: These variables are ONLY available on m_networkThread.
+    //
+    // The requests that are currently in progress.
+    struct ActiveRequest {
+        QNetworkReply* reply = nullptr;
+        QString host;
+        // The body is gathered here as it arrives.
+        QByteArray bytes;
+    };
+    std::map<RequestKey, ActiveRequest> m_activeRequests;
+    // Fetches waiting for their host to have room. Not kept sorted,
+    // since the priorities keep changing.
+    std::vector<QueuedFetch> m_queuedFetches;
+    std::map<QString, int> m_requestsInFlightPerHost;
+
+signals:
+    void urlTemplateChanged();
+    void cacheNameChanged();
+    void maxRequestsPerHostChanged();
+};
+
+// Reads tiles from a directory on the local filesystem.
+//
+// Useful for serving a local tile mirror, and for running
+// the whole loading pipeline offline.
+class LocalDirectoryTileSource : public TileSource
+{
+    Q_OBJECT
+    Q_PROPERTY(
+        QString path
+        READ getPath
+        WRITE setPath
+        NOTIFY pathChanged)
+
+    Q_PROPERTY(
+        QString fileNameTemplate
+        READ getFileNameTemplate
+        WRITE setFileNameTemplate
+        NOTIFY fileNameTemplateChanged)
+
+public:
+    explicit LocalDirectoryTileSource(QObject* parent = nullptr);
+
+    // The root directory of the tiles.
+    QString getPath() const;
+    void setPath(QString const& newValue);
+
+    // Path of a tile relative to the root directory, where {z}, {x} and {y}
+    // are replaced with the level and the coordinates of the tile.
+    //
+    // Defaults to {z}/{x}/{y}.pbf
+    QString getFileNameTemplate() const;
+    void setFileNameTemplate(QString const& newValue);
+
+    // The file is read on the calling thread, which is
+    // one of the TileLoader's I/O threads.
+    void fetchTile(TileCoord coord, FetchCallback callback) override;
+    bool isCacheable() const override { return false; }
+    QString getCacheName() const override { return "local"; }
+
+private:
+    // IMPORTANT: These variables are ONLY available when _propertiesLock is locked.
+    QString m_path;
+    QString m_fileNameTemplate = "{z}/{x}/{y}.pbf";
+    std::unique_ptr<std::mutex> _propertiesLock = std::make_unique<std::mutex>();
+
+signals:
+    void pathChanged();
+    void fileNameTemplateChanged();
+};
+
+#endif // TILESOURCE_H